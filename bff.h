@@ -3,6 +3,8 @@
 
 #include <string>
 
+#include "libbff.h"
+
 class cliopts
 {
 
@@ -10,7 +12,48 @@ public:
 
 	std::wstring input;
 	std::wstring output;
+	std::wstring mode;
 	int help;
+	int sample_step;
+	int sample_budget;
+	int packet_prefilter;
+	int prefilter_verify;
+	bff_rect region;
+	int auto_region;
+	std::vector<bff_rect> exclusions;
+	int bad_rect;
+	int detect_threads;
+	int sweep;
+	std::vector<double> sweep_y_max;
+	std::vector<double> sweep_proportion;
+	std::vector<double> sweep_mean;
+	std::vector<double> sweep_stdev;
+	int bad_list;
+	double checkpoint;
+	int resume;
+	int cache;
+	int refresh_cache;
+	double start;
+	double end;
+	int bad_time;
+	double memory_budget;
+	std::wstring metrics;
+	double metrics_interval;
+	std::vector<bff_rendition> renditions;
+	int bad_rendition;
+	std::wstring daemon;
+	int daemon_jobs;
+	double probe_size;
+	double analyze_duration;
+	int probe_cache;
+	double read_ahead;
+	int read_ahead_packets;
+	int drop_cache;
+	int direct_io;
+	int preallocate;
+	int fingerprint;
+	int fingerprint_verify;
+	int fingerprint_grid;
 
 	cliopts(int argc, wchar_t ** argv);
 	int check_syntax();
@@ -19,36 +62,474 @@ public:
 };
 
 
-class ffmpeg_error : public std::runtime_error
+struct SwsContext;
+
+typedef std::unique_ptr<AVFormatContext, std::function<void(AVFormatContext*)>> avformat_ptr;
+typedef std::unique_ptr<AVCodecContext, std::function<void(AVCodecContext*)>> avcodec_ptr;
+typedef std::unique_ptr<AVFrame, std::function<void(AVFrame*)>> avframe_ptr;
+typedef std::unique_ptr<AVPacket, std::function<void(AVPacket*)>> avpacket_ptr;
+typedef std::unique_ptr<AVFilterGraph, std::function<void(AVFilterGraph*)>> avfiltergraph_ptr;
+
+
+// a running total of the bytes held in the pipeline's large buffers (frames and queued packets) and its high-water mark
+class memory_account
 {
 private:
-	int _er;
-	std::string _fn;
-	std::string _arg;
-	std::string _msg;
-	static std::string format_message(int er, const char * fn, const char * arg);
+	std::atomic<int64_t> _live;
+	std::atomic<int64_t> _peak;
 public:
-	explicit ffmpeg_error(int av_error_code, const char * function_name, const char * function_args) : _er(av_error_code), _fn(function_name), _arg(function_args), _msg(format_message(av_error_code, function_name, function_args)), std::runtime_error(_msg)
-	{}
-	ffmpeg_error(const ffmpeg_error &e) : _er(e._er), _fn(e._fn), _arg(e._arg), _msg(e._msg), std::runtime_error(_msg)
+	memory_account();
+	void add(int64_t bytes);
+	void remove(int64_t bytes);
+	int64_t live() const;
+	int64_t peak() const;
+};
+
+// bounded, thread-safe FIFO of packets; producers block while it is full
+class packet_queue
+{
+private:
+	memory_account * _account;
+	std::mutex _mutex;
+	std::condition_variable _not_empty;
+	std::condition_variable _not_full;
+	std::deque<AVPacket *> _packets;
+	size_t _max_packets;
+	size_t _max_bytes;
+	size_t _bytes;
+	bool _closed;
+public:
+	packet_queue(size_t max_packets, size_t max_bytes, memory_account * account = nullptr);
+	~packet_queue();
+	bool push(AVPacket * packet);
+	bool pop(AVPacket * packet, double * waited = nullptr);
+	void close();
+	void clear();
+	void depth(size_t & packets, size_t & bytes);
+};
+
+// writes packets to an output format context from a dedicated thread, in timestamp order across the streams
+// however the threads producing them run ahead of one another
+class muxer
+{
+private:
+	AVFormatContext * _format;
+	memory_account * _account;
+	packet_queue _queue;
+	// packets taken from the queue and waiting for the other streams to catch up, by stream
+	std::vector<std::deque<AVPacket *>> _pending;
+	size_t _pending_count;
+	size_t _pending_bytes;
+	size_t _max_pending;
+	size_t _max_pending_bytes;
+	std::thread _thread;
+	std::mutex _mutex;
+	std::condition_variable _idle;
+	uint64_t _queued;
+	uint64_t _written;
+	double _busy;
+	std::exception_ptr _error;
+	void run();
+	void interleave(AVPacket * packet);
+	bool write_next(bool all);
+	void rethrow();
+public:
+	static const size_t default_max_packets = 512;
+	static const size_t default_max_bytes = 64 * 1024 * 1024;
+	muxer(AVFormatContext * format, size_t max_packets = default_max_packets, size_t max_bytes = default_max_bytes, memory_account * account = nullptr);
+	~muxer();
+	void write(AVPacket * packet);
+	void flush();
+	void finish();
+	double busy();
+	void depth(size_t & packets, size_t & bytes);
+};
+
+// rescales a packet's timestamps and keeps them strictly increasing past the last pts and dts written to its stream
+extern void rescale_packet(AVPacket * packet, AVRational from, AVRational to, int64_t & pts, int64_t & dts);
+
+// a fixed set of threads that run the parts of a data-parallel task, e.g. the stripes of a frame
+class worker_pool
+{
+private:
+	std::vector<std::thread> _threads;
+	std::mutex _mutex;
+	std::condition_variable _work;
+	std::condition_variable _done;
+	const std::function<void(int)> * _task;
+	int _tasks;
+	int _next;
+	int _pending;
+	uint64_t _generation;
+	bool _stop;
+	std::exception_ptr _error;
+	void drain(std::unique_lock<std::mutex> & lock);
+	void work();
+public:
+	explicit worker_pool(int threads);
+	~worker_pool();
+	static int default_threads(int threads);
+	static worker_pool * for_this_thread(int threads);
+	int size() const
+	{
+		return (int)_threads.size() + 1;
+	}
+	void run(int tasks, const std::function<void(int)> & task);
+};
+
+// AVIOContext over virtual read/write/seek operations using a single large aligned buffer
+class custom_io
+{
+private:
+	AVIOContext * _pb;
+	std::atomic<int64_t> _written;
+	static int read_packet(void * opaque, uint8_t * buf, int buf_size);
+	static int write_packet(void * opaque, uint8_t * buf, int buf_size);
+	static int64_t seek_packet(void * opaque, int64_t offset, int whence);
+protected:
+	void open(int buffer_size, bool writable, bool seekable);
+	void close();
+	virtual int read(uint8_t * buf, int buf_size);
+	virtual int write(const uint8_t * buf, int buf_size);
+	virtual int64_t seek(int64_t offset, int whence);
+public:
+	static const int default_buffer_size = 4 * 1024 * 1024;
+	custom_io();
+	virtual ~custom_io();
+	AVIOContext * context() const
+	{
+		return _pb;
+	}
+	// the bytes written so far; safe to read from any thread
+	int64_t bytes_written() const
+	{
+		return _written.load();
+	}
+};
+
+// how an output file is written so as to spare the page cache and the file system of a shared host; Linux only
+struct output_hints
+{
+	// start writing back each chunk of the output as it is completed, and drop it from the page cache once written
+	bool drop_cache = false;
+	// write whole aligned blocks with O_DIRECT, bypassing the page cache (where the file system supports it)
+	bool direct = false;
+	// reserve this many bytes of disk for the output up front; what is not used is released by finish()
+	int64_t preallocate = 0;
+};
+
+// seekable output to a file, replacing it if it exists, or continuing the first resume_size bytes of it
+class output_file : public custom_io
+{
+private:
+	FILE * _file;
+	// when continuing a file: output is dropped until append(), then offset by _base
+	bool _discarding;
+	int64_t _base;
+	output_hints _hints;
+	// with drop_cache: writeback has been started up to _started, and the page cache dropped up to _dropped
+	int64_t _started;
+	int64_t _dropped;
+	// with direct: a second descriptor opened with O_DIRECT, and the aligned buffer of the _staged bytes due at
+	// _staged_pos that it has yet to write
+	int _direct_fd;
+	std::unique_ptr<uint8_t, std::function<void(uint8_t*)>> _staging;
+	size_t _staging_size;
+	size_t _staged;
+	int64_t _staged_pos;
+	void apply_hints(const std::string & fname, int buffer_size);
+	int write_direct(const uint8_t * buf, int buf_size);
+	int flush_staged();
+	void release_written();
+protected:
+	virtual int write(const uint8_t * buf, int buf_size);
+	virtual int64_t seek(int64_t offset, int whence);
+public:
+	static const size_t direct_alignment = 4096;
+	output_file(const std::string & fname, const output_hints & hints = output_hints(), int buffer_size = default_buffer_size);
+	output_file(const std::string & fname, int64_t resume_size, const output_hints & hints = output_hints(), int buffer_size = default_buffer_size);
+	virtual ~output_file();
+	void append(int64_t pos);
+	int64_t size() const;
+	void flush();
+	void finish();
+};
+
+// input or output through the caller's bff_reader/bff_writer callbacks
+class callback_io : public custom_io
+{
+private:
+	bff_reader * _reader;
+	bff_writer * _writer;
+protected:
+	virtual int read(uint8_t * buf, int buf_size);
+	virtual int write(const uint8_t * buf, int buf_size);
+	virtual int64_t seek(int64_t offset, int whence);
+public:
+	explicit callback_io(bff_reader & reader, int buffer_size = default_buffer_size);
+	explicit callback_io(bff_writer & writer, int buffer_size = default_buffer_size);
+	virtual ~callback_io();
+};
+
+// replaces a file with bytes through fname.tmp, flushed to disk before it is renamed so that a crash leaves the old
+// file or the new one but never a partial one; returns 0 or an AVERROR code
+extern int write_file_atomically(const std::string & fname, const std::string & bytes);
+
+// the parts of a run whose busy time is reported
+enum job_stage
+{
+	stage_read,
+	stage_decode,
+	stage_deinterlace,
+	stage_detect,
+	stage_encode,
+	stage_mux,
+	stage_count
+};
+
+// adds the time from its construction until stop() (or its destruction) to a busy time in seconds
+class stage_timer
+{
+private:
+	double * _busy;
+	std::chrono::steady_clock::time_point _start;
+public:
+	explicit stage_timer(double & busy) : _busy(&busy), _start(std::chrono::steady_clock::now())
 	{}
-	~ffmpeg_error()
+	~stage_timer()
+	{
+		stop();
+	}
+	void stop()
+	{
+		if (_busy) {
+			*_busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+			_busy = nullptr;
+		}
+	}
+};
+
+// a snapshot of a run for monitoring
+struct job_metrics
+{
+	bff_stats stats;
+	double busy[stage_count] = { 0 };
+	size_t mux_queue_packets = 0;
+	size_t mux_queue_bytes = 0;
+	size_t read_queue_packets = 0;
+	size_t read_queue_bytes = 0;
+	size_t encoder_frames = 0;
+	size_t held_audio_frames = 0;
+	int64_t bytes_read = 0;
+	int64_t bytes_written = 0;
+	int64_t memory_bytes = 0;
+};
+
+// rewrites a Prometheus text format file with the latest snapshot of a run at intervals, from its own thread
+class metrics_writer
+{
+private:
+	std::string _file;
+	std::string _input;
+	double _interval;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	bool _stopping;
+	job_metrics _metrics;
+	uint64_t _last_frames;
+	std::chrono::steady_clock::time_point _last_time;
+	int64_t _progress_time;
+	// when the pipeline next refreshes the snapshot; only the thread calling update() uses it
+	std::chrono::steady_clock::time_point _next_update;
+	std::thread _thread;
+	void run();
+	void write(const job_metrics & metrics, double fps, bool running);
+public:
+	metrics_writer(const std::string & fname, const std::string & input, double interval);
+	~metrics_writer();
+	bool due();
+	void update(const job_metrics & metrics);
+};
+
+// writes a scaled re-encoding of the video frames given to it, and copies of the audio packets, to another file;
+// the frames are scaled and encoded on its own thread
+class rendition
+{
+private:
+	bff_rendition _spec;
+	memory_account * _account;
+	std::unique_ptr<output_file> _io;
+	avformat_ptr _format;
+	avcodec_ptr _codec;
+	AVStream * _vstream;
+	AVStream * _astream;
+	std::unique_ptr<SwsContext, std::function<void(SwsContext*)>> _sws;
+	int64_t _vpts, _vdts, _apts, _adts;
+	// frames waiting for the encoder thread, and whether the last has been given
+	std::mutex _mutex;
+	std::condition_variable _not_empty;
+	std::condition_variable _not_full;
+	std::deque<avframe_ptr> _frames;
+	bool _ended;
+	std::exception_ptr _error;
+	std::thread _thread;
+	// declared last so that the writer thread is stopped before the output is torn down
+	std::unique_ptr<muxer> _mux;
+	void run();
+	void encode(AVFrame * frame);
+	void stop();
+public:
+	static const size_t max_frames = 4;
+	rendition(const bff_rendition & spec, const AVCodecContext * video, const AVCodecContext * audio, const AVStream * audio_stream, int lookahead, size_t queue_bytes, memory_account * account, const output_hints & hints);
+	~rendition();
+	static void frame_size(const bff_rendition & spec, const AVCodecContext * video, int & width, int & height);
+	void write_video(const AVFrame * frame);
+	void write_audio(const AVPacket * packet, AVRational time_base);
+	void finish();
+};
+
+// what a run needs to continue from its last checkpoint; timestamps are in the encoder time bases
+struct checkpoint_state
+{
+	std::string input;
+	// the output is kept up to here, the end of the last complete fragment
+	int64_t output_size = 0;
+	int fragments = 0;
+	// the first video frame and the end of the audio not yet in the output
+	int64_t video_pts = 0;
+	int64_t audio_end = 0;
+	// timestamp watermarks of the packets written, in the stream time bases
+	int64_t vpts = 0, vdts = 0, apts = 0, adts = 0;
+	uint64_t frame_number = 0;
+	bff_stats stats;
+	bool load(const std::string & fname);
+	void save(const std::string & fname) const;
+};
+
+// per frame verdicts kept beside an input, so that a later run with the same detector settings can skip detection
+class verdict_cache
+{
+private:
+	std::string _file;
+	std::vector<std::pair<int64_t, bool>> _cached;
+	std::vector<std::pair<int64_t, bool>> _recorded;
+	bool _complete;
+public:
+	verdict_cache(const std::string & input, const bff_detector_options & opts);
+	bool load();
+	bool lookup(uint64_t frame_number, int64_t pts, bool & black) const;
+	void record(uint64_t frame_number, int64_t pts, bool black);
+	void save() const;
+};
+
+// the stream parameters avformat_find_stream_info() found in an input file, kept beside it so that opening the same
+// input again can skip probing
+class stream_info_cache
+{
+private:
+	std::string _file;
+public:
+	explicit stream_info_cache(const std::string & input);
+	bool apply(AVFormatContext * format) const;
+	void drop() const;
+	void save(const AVFormatContext * format) const;
+};
+
+// counts of the luma samples examined in a frame by level, at the bit depth of its pixel format;
+// the detectors derive all of their metrics from it
+class luma_histogram
+{
+private:
+	std::vector<uint64_t> _counts;
+	uint64_t _samples;
+	int _depth;
+public:
+	luma_histogram() : _samples(0), _depth(8)
 	{}
-	int error_code() const
+	void reset(int depth);
+	void add(const uint32_t * counts);
+	int depth() const
+	{
+		return _depth;
+	}
+	uint64_t samples() const
 	{
-		return _er;
+		return _samples;
 	}
-	const char * function_name() const
+	uint64_t at_or_below(int level) const;
+	double proportion_at_or_below(int level) const;
+	void statistics(double * range_min, double * range_max, double * mean, double * stdev) const;
+};
+
+// true if the detectors can read frames of this pixel format without conversion
+extern bool is_black_frame_supported(int format);
+// detects a black frame, splitting large frames into stripes across the workers if given
+extern bool is_black_frame(AVFrame * frame, const bff_detector_options & opts, worker_pool * workers = nullptr);
+// the detector's verdict on an already scanned histogram, so that several configurations can share one scan
+extern void scan_luma_histogram(AVFrame * frame, const bff_detector_options & opts, worker_pool * workers, luma_histogram & histogram);
+extern bool is_black_frame(const luma_histogram & histogram, const bff_detector_options & opts);
+// a hash of a sparse grid of the luma samples the detectors examine, to recognise a frame repeating the one before
+extern uint64_t frame_fingerprint(const AVFrame * frame, const bff_detector_options & opts);
+
+// learns per picture type packet sizes to rule out black frames without scanning their pixels
+class packet_size_prefilter
+{
+private:
+	struct picture_type_sizes
+	{
+		int black_max = 0;
+		uint64_t seen = 0;
+	};
+	struct sent_packet
+	{
+		int64_t pts;
+		int64_t dts;
+		int size;
+	};
+	// packets sent to the decoder whose frames have not been judged yet; enough to cover reordering and frame threads
+	static const size_t pending_max = 128;
+	const bff_detector_options & _opts;
+	picture_type_sizes _types[8];
+	std::deque<sent_packet> _pending;
+	picture_type_sizes & sizes(const AVFrame * frame);
+public:
+	explicit packet_size_prefilter(const bff_detector_options & opts) : _opts(opts)
+	{}
+	// remembers the size of a packet sent to the decoder, so that it can be matched to its frame by timestamp
+	void sent(const AVPacket * packet);
+	// the size of the packet a frame was decoded from, or -1 if it is not known; AVFrame::pkt_size cannot be trusted
+	// once frames are reordered or decoded on several threads
+	int size_of(const AVFrame * frame);
+	bool could_be_black(const AVFrame * frame, int size);
+	void learn(const AVFrame * frame, int size, bool black);
+};
+
+// finds the part of the frame inside letterbox or pillarbox bars from the first few frames with picture content
+class letterbox_detector
+{
+private:
+	int _y_max;
+	int _frames_needed;
+	int _frames;
+	bff_rect _area;
+public:
+	explicit letterbox_detector(const bff_detector_options & opts) : _y_max(opts.y_max), _frames_needed(std::max(opts.auto_region_frames, 1)), _frames(0)
+	{}
+	bool observe(const AVFrame * frame);
+	bool settled() const
 	{
-		return _fn.c_str();
+		return _frames >= _frames_needed;
 	}
-	const char * function_args() const
+	// the union of the picture content seen so far
+	const bff_rect & area() const
 	{
-		return _arg.c_str();
+		return _area;
 	}
 };
 
 extern int bff(const cliopts & opts);
+extern bff_options pipeline_options(const cliopts & opts);
+extern int bff_daemon(const cliopts & opts);
 extern std::string utf8(const std::wstring & s);
 extern std::wstring utf8(const std::string & s);
 extern std::string ansi(const std::wstring & s);
@@ -0,0 +1,350 @@
+/*	bff - Black Frame Filter for FFmpeg
+	Copyright (C) 2017 Michael Trenholm-Boyle.
+	This software is redistributable under a permissive open source license.
+	See the LICENSE file for further information. */
+#include "stdafx.h"
+
+#include "bff.h"
+
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+
+static const char cache_magic[8] = { 'b', 'f', 'f', 'v', 'e', 'r', 'd', '1' };
+static const char stream_info_magic[] = "bff-streams 1";
+
+// FNV-1a, 64 bits
+static uint64_t fnv1a(uint64_t hash, const void * data, size_t size)
+{
+	const uint8_t * p = (const uint8_t *)data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// hashes the size and modification time of a file and 16 blocks of 64 KiB spread evenly over it, including its
+// first and last; the blocks alone miss an edit in place between them. returns 0 if the file cannot be read
+static uint64_t content_hash(const std::string & fname)
+{
+	const int blocks = 16;
+	const size_t block_size = 64 * 1024;
+	struct stat st = {};
+	if (stat(fname.c_str(), &st) != 0) {
+		return 0;
+	}
+	FILE * f = fopen(fname.c_str(), "rb");
+	if (!f) {
+		return 0;
+	}
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	std::vector<uint8_t> buf(block_size);
+	int64_t size = (fseek64(f, 0, SEEK_END) == 0) ? ftell64(f) : -1;
+	int64_t mtime = (int64_t)st.st_mtime;
+	hash = fnv1a(hash, &size, sizeof(size));
+	hash = fnv1a(hash, &mtime, sizeof(mtime));
+	for (int i = 0; (size > 0) && (i < blocks); ++i) {
+		int64_t pos = std::max<int64_t>(size - (int64_t)block_size, 0) * i / (blocks - 1);
+		if (fseek64(f, pos, SEEK_SET) != 0) {
+			break;
+		}
+		size_t n = fread(buf.data(), 1, block_size, f);
+		hash = fnv1a(hash, buf.data(), n);
+	}
+	fclose(f);
+	return hash;
+}
+
+// everything that can change a verdict; the number of threads cannot
+static uint64_t detector_hash(const bff_detector_options & opts)
+{
+	std::ostringstream s;
+	s.precision(17);
+	s << (int)opts.detection << ' ' << opts.y_max << ' ' << opts.proportion_threshold << ' ' << opts.mean_threshold << ' ' << opts.stdev_threshold;
+	s << ' ' << opts.region.x << ',' << opts.region.y << ',' << opts.region.width << ',' << opts.region.height;
+	s << ' ' << opts.auto_region << ' ' << opts.auto_region_frames;
+	for (const bff_rect & r : opts.exclusions) {
+		s << ' ' << r.x << ',' << r.y << ',' << r.width << ',' << r.height;
+	}
+	s << ' ' << opts.sample_step << ' ' << opts.sample_budget << ' ' << opts.sample_error_z;
+	s << ' ' << opts.packet_prefilter << ' ' << opts.prefilter_warmup << ' ' << opts.prefilter_factor << ' ' << opts.prefilter_verify;
+	if (opts.fingerprint) {
+		s << " fingerprint " << opts.fingerprint_grid << ' ' << opts.fingerprint_verify;
+	}
+	std::string text = s.str();
+	return fnv1a(0xcbf29ce484222325ULL, text.data(), text.size());
+}
+
+
+// the cache of an input lives beside it, named for the input's content and the detector settings
+verdict_cache::verdict_cache(const std::string & input, const bff_detector_options & opts) : _complete(true)
+{
+	uint64_t content = content_hash(input);
+	if (content) {
+		char name[40] = { 0 };
+		snprintf(name, sizeof(name) - 1, ".%016llx.bffv", (unsigned long long)(content ^ detector_hash(opts)));
+		_file = input + name;
+	}
+}
+
+// reads the verdicts of an earlier run; returns false if there are none
+bool verdict_cache::load()
+{
+	if (_file.empty()) {
+		return false;
+	}
+	FILE * f = fopen(_file.c_str(), "rb");
+	if (!f) {
+		return false;
+	}
+	char magic[sizeof(cache_magic)] = { 0 };
+	uint64_t count = 0;
+	bool ok = (fread(magic, 1, sizeof(magic), f) == sizeof(magic)) && (memcmp(magic, cache_magic, sizeof(magic)) == 0) && (fread(&count, sizeof(count), 1, f) == 1);
+	std::vector<std::pair<int64_t, bool>> verdicts;
+	for (uint64_t i = 0; ok && (i < count); ++i) {
+		int64_t pts = 0;
+		uint8_t black = 0;
+		ok = (fread(&pts, sizeof(pts), 1, f) == 1) && (fread(&black, sizeof(black), 1, f) == 1);
+		verdicts.push_back(std::make_pair(pts, black != 0));
+	}
+	fclose(f);
+	if (ok) {
+		_cached.swap(verdicts);
+	}
+	return ok;
+}
+
+// the cached verdict for a frame, if there is one for a frame with this timestamp
+bool verdict_cache::lookup(uint64_t frame_number, int64_t pts, bool & black) const
+{
+	if ((frame_number >= _cached.size()) || (_cached[(size_t)frame_number].first != pts)) {
+		return false;
+	}
+	black = _cached[(size_t)frame_number].second;
+	return true;
+}
+
+// notes the verdict for a frame; only a run that saw every frame from the first can be saved
+void verdict_cache::record(uint64_t frame_number, int64_t pts, bool black)
+{
+	if (frame_number < _recorded.size()) {
+		_recorded[(size_t)frame_number] = std::make_pair(pts, black);
+	} else if (frame_number == _recorded.size()) {
+		_recorded.push_back(std::make_pair(pts, black));
+	} else {
+		_complete = false;
+	}
+}
+
+// writes the recorded verdicts if they differ from the cached ones; like the stream info cache, a cache that cannot be
+// written is skipped with a warning rather than failing a run whose output is already complete
+void verdict_cache::save() const
+{
+	if (_file.empty() || !_complete || (_recorded == _cached)) {
+		return;
+	}
+	uint64_t count = _recorded.size();
+	std::string bytes(cache_magic, sizeof(cache_magic));
+	bytes.append((const char *)&count, sizeof(count));
+	for (const std::pair<int64_t, bool> & verdict : _recorded) {
+		char black = verdict.second ? 1 : 0;
+		bytes.append((const char *)&verdict.first, sizeof(verdict.first));
+		bytes.append(1, black);
+	}
+	int rv = write_file_atomically(_file, bytes);
+	if (rv < 0) {
+		av_log(nullptr, AV_LOG_WARNING, "%s\n", ffmpeg_error(rv, "write_file_atomically", _file.c_str()).what());
+	}
+}
+
+
+// extradata as it is written to the cache
+static std::string hex_string(const uint8_t * data, int size)
+{
+	std::string hex;
+	for (int i = 0; i < size; ++i) {
+		char digits[3] = { 0 };
+		snprintf(digits, sizeof(digits), "%02x", data[i]);
+		hex += digits;
+	}
+	return hex;
+}
+
+// the stream parameters of an input live beside it, named for its content
+stream_info_cache::stream_info_cache(const std::string & input)
+{
+	uint64_t content = content_hash(input);
+	if (content) {
+		char name[40] = { 0 };
+		snprintf(name, sizeof(name) - 1, ".%016llx.bffs", (unsigned long long)content);
+		_file = input + name;
+	}
+}
+
+// fills in the parameters of the streams of an input just opened, as avformat_find_stream_info() would have;
+// returns false, changing nothing, if none are cached or the demuxer's streams are not the ones cached
+bool stream_info_cache::apply(AVFormatContext * format) const
+{
+	if (_file.empty()) {
+		return false;
+	}
+	std::ifstream in(_file);
+	std::string line;
+	if (!in || !std::getline(in, line) || (line != stream_info_magic)) {
+		return false;
+	}
+	std::map<std::string, std::string> values;
+	while (std::getline(in, line)) {
+		size_t eq = line.find('=');
+		if (eq != std::string::npos) {
+			values[line.substr(0, eq)] = line.substr(eq + 1);
+		}
+	}
+	auto get = [&values](const std::string & key) {
+		return strtoll(values[key].c_str(), nullptr, 10);
+	};
+	auto get_q = [&values](const std::string & key) {
+		AVRational q = { 0, 1 };
+		sscanf(values[key].c_str(), "%d/%d", &q.num, &q.den);
+		return q;
+	};
+	// the demuxer's header (e.g. an MPEG-TS program map) must give the streams cached, though it may not yet know their codecs
+	if ((values.find("streams") == values.end()) || (get("streams") != (int64_t)format->nb_streams)) {
+		return false;
+	}
+	for (unsigned i = 0; i < format->nb_streams; ++i) {
+		const AVCodecParameters * par = format->streams[i]->codecpar;
+		std::string p = std::to_string(i) + ".";
+		if ((get(p + "codec_type") != (int64_t)par->codec_type) || ((par->codec_id != AV_CODEC_ID_NONE) && (get(p + "codec_id") != (int64_t)par->codec_id))) {
+			return false;
+		}
+		// so must any extradata the header gives (e.g. an MP4 avcC box)
+		if ((par->extradata_size > 0) && (hex_string(par->extradata, par->extradata_size) != values[p + "extradata"])) {
+			return false;
+		}
+	}
+	format->start_time = get("start_time");
+	format->duration = get("duration");
+	format->bit_rate = get("bit_rate");
+	for (unsigned i = 0; i < format->nb_streams; ++i) {
+		AVStream * st = format->streams[i];
+		AVCodecParameters * par = st->codecpar;
+		std::string p = std::to_string(i) + ".";
+		st->time_base = get_q(p + "time_base");
+		st->start_time = get(p + "start_time");
+		st->duration = get(p + "duration");
+		st->sample_aspect_ratio = get_q(p + "sample_aspect_ratio");
+		st->avg_frame_rate = get_q(p + "avg_frame_rate");
+		st->r_frame_rate = get_q(p + "r_frame_rate");
+		par->codec_id = (AVCodecID)get(p + "codec_id");
+		par->codec_tag = (uint32_t)get(p + "codec_tag");
+		par->format = (int)get(p + "format");
+		par->bit_rate = get(p + "bit_rate");
+		par->bits_per_coded_sample = (int)get(p + "bits_per_coded_sample");
+		par->bits_per_raw_sample = (int)get(p + "bits_per_raw_sample");
+		par->profile = (int)get(p + "profile");
+		par->level = (int)get(p + "level");
+		par->width = (int)get(p + "width");
+		par->height = (int)get(p + "height");
+		par->sample_aspect_ratio = get_q(p + "codec_sample_aspect_ratio");
+		par->field_order = (AVFieldOrder)get(p + "field_order");
+		par->color_range = (AVColorRange)get(p + "color_range");
+		par->color_primaries = (AVColorPrimaries)get(p + "color_primaries");
+		par->color_trc = (AVColorTransferCharacteristic)get(p + "color_trc");
+		par->color_space = (AVColorSpace)get(p + "color_space");
+		par->chroma_location = (AVChromaLocation)get(p + "chroma_location");
+		par->video_delay = (int)get(p + "video_delay");
+		par->channel_layout = strtoull(values[p + "channel_layout"].c_str(), nullptr, 10);
+		par->channels = (int)get(p + "channels");
+		par->sample_rate = (int)get(p + "sample_rate");
+		par->block_align = (int)get(p + "block_align");
+		par->frame_size = (int)get(p + "frame_size");
+		par->initial_padding = (int)get(p + "initial_padding");
+		const std::string & hex = values[p + "extradata"];
+		if (!hex.empty()) {
+			av_freep(&par->extradata);
+			par->extradata_size = 0;
+			par->extradata = (uint8_t *)av_mallocz(hex.size() / 2 + AV_INPUT_BUFFER_PADDING_SIZE);
+			if (!par->extradata) {
+				throw ffmpeg_error(AVERROR(ENOMEM), "av_mallocz", "extradata");
+			}
+			for (size_t j = 0; j + 1 < hex.size(); j += 2) {
+				par->extradata[par->extradata_size++] = (uint8_t)strtoul(hex.substr(j, 2).c_str(), nullptr, 16);
+			}
+		}
+	}
+	return true;
+}
+
+// removes parameters found not to describe the input
+void stream_info_cache::drop() const
+{
+	if (!_file.empty()) {
+		remove(_file.c_str());
+	}
+}
+
+// writes the parameters found by probing; a cache that cannot be written is skipped with a warning rather than failing the run
+void stream_info_cache::save(const AVFormatContext * format) const
+{
+	if (_file.empty()) {
+		return;
+	}
+	std::ostringstream out;
+	out << stream_info_magic << "\n";
+	out << "streams=" << format->nb_streams << "\n";
+	out << "start_time=" << format->start_time << "\n";
+	out << "duration=" << format->duration << "\n";
+	out << "bit_rate=" << format->bit_rate << "\n";
+	for (unsigned i = 0; i < format->nb_streams; ++i) {
+		const AVStream * st = format->streams[i];
+		const AVCodecParameters * par = st->codecpar;
+		std::string p = std::to_string(i) + ".";
+		out << p << "time_base=" << st->time_base.num << "/" << st->time_base.den << "\n";
+		out << p << "start_time=" << st->start_time << "\n";
+		out << p << "duration=" << st->duration << "\n";
+		out << p << "sample_aspect_ratio=" << st->sample_aspect_ratio.num << "/" << st->sample_aspect_ratio.den << "\n";
+		out << p << "avg_frame_rate=" << st->avg_frame_rate.num << "/" << st->avg_frame_rate.den << "\n";
+		out << p << "r_frame_rate=" << st->r_frame_rate.num << "/" << st->r_frame_rate.den << "\n";
+		out << p << "codec_type=" << par->codec_type << "\n";
+		out << p << "codec_id=" << par->codec_id << "\n";
+		out << p << "codec_tag=" << par->codec_tag << "\n";
+		out << p << "format=" << par->format << "\n";
+		out << p << "bit_rate=" << par->bit_rate << "\n";
+		out << p << "bits_per_coded_sample=" << par->bits_per_coded_sample << "\n";
+		out << p << "bits_per_raw_sample=" << par->bits_per_raw_sample << "\n";
+		out << p << "profile=" << par->profile << "\n";
+		out << p << "level=" << par->level << "\n";
+		out << p << "width=" << par->width << "\n";
+		out << p << "height=" << par->height << "\n";
+		out << p << "codec_sample_aspect_ratio=" << par->sample_aspect_ratio.num << "/" << par->sample_aspect_ratio.den << "\n";
+		out << p << "field_order=" << par->field_order << "\n";
+		out << p << "color_range=" << par->color_range << "\n";
+		out << p << "color_primaries=" << par->color_primaries << "\n";
+		out << p << "color_trc=" << par->color_trc << "\n";
+		out << p << "color_space=" << par->color_space << "\n";
+		out << p << "chroma_location=" << par->chroma_location << "\n";
+		out << p << "video_delay=" << par->video_delay << "\n";
+		out << p << "channel_layout=" << par->channel_layout << "\n";
+		out << p << "channels=" << par->channels << "\n";
+		out << p << "sample_rate=" << par->sample_rate << "\n";
+		out << p << "block_align=" << par->block_align << "\n";
+		out << p << "frame_size=" << par->frame_size << "\n";
+		out << p << "initial_padding=" << par->initial_padding << "\n";
+		out << p << "extradata=" << hex_string(par->extradata, par->extradata_size) << "\n";
+	}
+	int rv = write_file_atomically(_file, out.str());
+	if (rv < 0) {
+		av_log(nullptr, AV_LOG_WARNING, "%s\n", ffmpeg_error(rv, "write_file_atomically", _file.c_str()).what());
+	}
+}
@@ -0,0 +1,91 @@
+/*	bff - Black Frame Filter for FFmpeg
+	Copyright (C) 2017 Michael Trenholm-Boyle.
+	This software is redistributable under a permissive open source license.
+	See the LICENSE file for further information. */
+#include "stdafx.h"
+
+#include "bff.h"
+
+#include <fstream>
+#include <map>
+#include <sstream>
+
+
+static const char checkpoint_magic[] = "bff-checkpoint 1";
+
+// reads a checkpoint written by save(); returns false if there is none or it cannot be used
+bool checkpoint_state::load(const std::string & fname)
+{
+	std::ifstream in(fname);
+	std::string line;
+	if (!in || !std::getline(in, line) || (line != checkpoint_magic)) {
+		return false;
+	}
+	std::map<std::string, std::string> values;
+	while (std::getline(in, line)) {
+		size_t eq = line.find('=');
+		if (eq != std::string::npos) {
+			values[line.substr(0, eq)] = line.substr(eq + 1);
+		}
+	}
+	const char * keys[] = { "input", "output_size", "fragments", "video_pts", "audio_end", "vpts", "vdts", "apts", "adts", "frame_number", "end" };
+	for (const char * key : keys) {
+		if (values.find(key) == values.end()) {
+			return false;
+		}
+	}
+	input = values["input"];
+	output_size = strtoll(values["output_size"].c_str(), nullptr, 10);
+	fragments = (int)strtol(values["fragments"].c_str(), nullptr, 10);
+	video_pts = strtoll(values["video_pts"].c_str(), nullptr, 10);
+	audio_end = strtoll(values["audio_end"].c_str(), nullptr, 10);
+	vpts = strtoll(values["vpts"].c_str(), nullptr, 10);
+	vdts = strtoll(values["vdts"].c_str(), nullptr, 10);
+	apts = strtoll(values["apts"].c_str(), nullptr, 10);
+	adts = strtoll(values["adts"].c_str(), nullptr, 10);
+	frame_number = strtoull(values["frame_number"].c_str(), nullptr, 10);
+	stats.video_frame_count = strtoull(values["video_frame_count"].c_str(), nullptr, 10);
+	stats.audio_frame_count = strtoull(values["audio_frame_count"].c_str(), nullptr, 10);
+	stats.black_frame_count = strtoull(values["black_frame_count"].c_str(), nullptr, 10);
+	stats.video_packet_count = strtoull(values["video_packet_count"].c_str(), nullptr, 10);
+	stats.audio_packet_count = strtoull(values["audio_packet_count"].c_str(), nullptr, 10);
+	stats.scans_avoided = strtoull(values["scans_avoided"].c_str(), nullptr, 10);
+	stats.prefilter_misses = strtoull(values["prefilter_misses"].c_str(), nullptr, 10);
+	stats.fingerprint_hits = strtoull(values["fingerprint_hits"].c_str(), nullptr, 10);
+	stats.fingerprint_misses = strtoull(values["fingerprint_misses"].c_str(), nullptr, 10);
+	stats.cached_verdicts = strtoull(values["cached_verdicts"].c_str(), nullptr, 10);
+	return output_size > 0;
+}
+
+// replaces the last checkpoint atomically, so that a crash leaves one intact
+void checkpoint_state::save(const std::string & fname) const
+{
+	std::ostringstream out;
+	out << checkpoint_magic << "\n";
+	out << "input=" << input << "\n";
+	out << "output_size=" << output_size << "\n";
+	out << "fragments=" << fragments << "\n";
+	out << "video_pts=" << video_pts << "\n";
+	out << "audio_end=" << audio_end << "\n";
+	out << "vpts=" << vpts << "\n";
+	out << "vdts=" << vdts << "\n";
+	out << "apts=" << apts << "\n";
+	out << "adts=" << adts << "\n";
+	out << "frame_number=" << frame_number << "\n";
+	out << "video_frame_count=" << stats.video_frame_count << "\n";
+	out << "audio_frame_count=" << stats.audio_frame_count << "\n";
+	out << "black_frame_count=" << stats.black_frame_count << "\n";
+	out << "video_packet_count=" << stats.video_packet_count << "\n";
+	out << "audio_packet_count=" << stats.audio_packet_count << "\n";
+	out << "scans_avoided=" << stats.scans_avoided << "\n";
+	out << "prefilter_misses=" << stats.prefilter_misses << "\n";
+	out << "fingerprint_hits=" << stats.fingerprint_hits << "\n";
+	out << "fingerprint_misses=" << stats.fingerprint_misses << "\n";
+	out << "cached_verdicts=" << stats.cached_verdicts << "\n";
+	// a checkpoint cut short by a crash has no end marker and is ignored
+	out << "end=\n";
+	int rv = write_file_atomically(fname, out.str());
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "write_file_atomically", fname.c_str());
+	}
+}
@@ -5,7 +5,118 @@
 
 #include "getopt.h"
 
-cliopts::cliopts(int argc, wchar_t ** argv) : help(0)
+#include <cwchar>
+
+// values for long options that have no short form
+enum {
+	OPT_MODE = 0x100,
+	OPT_SAMPLE_STEP,
+	OPT_SAMPLE_BUDGET,
+	OPT_PACKET_PREFILTER,
+	OPT_PREFILTER_VERIFY,
+	OPT_REGION,
+	OPT_AUTO_REGION,
+	OPT_EXCLUDE,
+	OPT_DETECT_THREADS,
+	OPT_SWEEP,
+	OPT_SWEEP_Y_MAX,
+	OPT_SWEEP_PROPORTION,
+	OPT_SWEEP_MEAN,
+	OPT_SWEEP_STDEV,
+	OPT_CHECKPOINT,
+	OPT_RESUME,
+	OPT_CACHE,
+	OPT_REFRESH_CACHE,
+	OPT_START,
+	OPT_END,
+	OPT_MEMORY_BUDGET,
+	OPT_METRICS,
+	OPT_METRICS_INTERVAL,
+	OPT_RENDITION,
+	OPT_DAEMON,
+	OPT_DAEMON_JOBS,
+	OPT_PROBESIZE,
+	OPT_ANALYZEDURATION,
+	OPT_PROBE_CACHE,
+	OPT_READ_AHEAD,
+	OPT_READ_AHEAD_PACKETS,
+	OPT_DROP_CACHE,
+	OPT_DIRECT_IO,
+	OPT_PREALLOCATE,
+	OPT_FINGERPRINT,
+	OPT_FINGERPRINT_VERIFY,
+	OPT_FINGERPRINT_GRID
+};
+
+// parses x,y,width,height; returns false if the rectangle is malformed
+static bool parse_rect(const wchar_t * s, bff_rect & r)
+{
+	wchar_t end = 0;
+	if (swscanf(s, L"%d,%d,%d,%d%lc", &r.x, &r.y, &r.width, &r.height, &end) != 4) {
+		return false;
+	}
+	return (r.x >= 0) && (r.y >= 0) && (r.width >= 0) && (r.height >= 0);
+}
+
+// parses a comma separated list of numbers; returns false if it is malformed
+static bool parse_list(const wchar_t * s, std::vector<double> & values)
+{
+	values.clear();
+	while (*s) {
+		wchar_t * end = nullptr;
+		double v = wcstod(s, &end);
+		if ((end == s) || ((*end != L',') && (*end != 0))) {
+			return false;
+		}
+		values.push_back(v);
+		s = *end ? end + 1 : end;
+	}
+	return !values.empty();
+}
+
+// parses WIDTHxHEIGHT,KBPS,FILE, where either dimension may be left out or 0; returns false if it is malformed
+static bool parse_rendition(const wchar_t * s, bff_rendition & r)
+{
+	wchar_t * end = nullptr;
+	r.width = (int)wcstol(s, &end, 10);
+	if (*end != L'x') {
+		return false;
+	}
+	r.height = (int)wcstol(end + 1, &end, 10);
+	if (*end != L',') {
+		return false;
+	}
+	const wchar_t * kbps = end + 1;
+	r.bit_rate = (int64_t)(wcstod(kbps, &end) * 1000);
+	if ((end == kbps) || (*end != L',') || !end[1]) {
+		return false;
+	}
+	r.output = ansi(std::wstring(end + 1));
+	return (r.width >= 0) && (r.height >= 0) && (r.bit_rate >= 0);
+}
+
+// parses seconds or [hh:]mm:ss[.fff]; returns a negative value if the time is malformed
+static double parse_time(const wchar_t * s)
+{
+	double seconds = 0;
+	int fields = 0;
+	while (true) {
+		wchar_t * end = nullptr;
+		double v = wcstod(s, &end);
+		if ((end == s) || (v < 0) || (++fields > 3)) {
+			return -1;
+		}
+		seconds = seconds * 60 + v;
+		if (*end == 0) {
+			return seconds;
+		} else if (*end != L':') {
+			return -1;
+		}
+		s = end + 1;
+	}
+}
+
+cliopts::cliopts(int argc, wchar_t ** argv) : mode(L"substitute"), help(0), sample_step(1), sample_budget(0), packet_prefilter(0), prefilter_verify(0), auto_region(0), bad_rect(0), detect_threads(0), sweep(0), bad_list(0), checkpoint(0), resume(0), cache(0), refresh_cache(0), start(0), end(0), bad_time(0), memory_budget(0), metrics_interval(10), bad_rendition(0), daemon_jobs(1), probe_size(0), analyze_duration(0), probe_cache(0), read_ahead(0), read_ahead_packets(8192), drop_cache(0), direct_io(0), preallocate(0), fingerprint(0), fingerprint_verify(0), fingerprint_grid(64)
 {
 	int c;
 	static struct option long_options[] = {
@@ -13,10 +124,49 @@ cliopts::cliopts(int argc, wchar_t ** argv) : help(0)
 		{ L"in", 1, nullptr, 'i' },
 		{ L"output", 1, nullptr, 'o' },
 		{ L"out", 1, nullptr, 'o' },
+		{ L"mode", 1, nullptr, OPT_MODE },
+		{ L"sample-step", 1, nullptr, OPT_SAMPLE_STEP },
+		{ L"sample-budget", 1, nullptr, OPT_SAMPLE_BUDGET },
+		{ L"packet-prefilter", 0, nullptr, OPT_PACKET_PREFILTER },
+		{ L"prefilter-verify", 0, nullptr, OPT_PREFILTER_VERIFY },
+		{ L"fingerprint", 0, nullptr, OPT_FINGERPRINT },
+		{ L"fingerprint-verify", 0, nullptr, OPT_FINGERPRINT_VERIFY },
+		{ L"fingerprint-grid", 1, nullptr, OPT_FINGERPRINT_GRID },
+		{ L"region", 1, nullptr, OPT_REGION },
+		{ L"auto-region", 0, nullptr, OPT_AUTO_REGION },
+		{ L"exclude", 1, nullptr, OPT_EXCLUDE },
+		{ L"detect-threads", 1, nullptr, OPT_DETECT_THREADS },
+		{ L"sweep", 0, nullptr, OPT_SWEEP },
+		{ L"sweep-y-max", 1, nullptr, OPT_SWEEP_Y_MAX },
+		{ L"sweep-proportion", 1, nullptr, OPT_SWEEP_PROPORTION },
+		{ L"sweep-mean", 1, nullptr, OPT_SWEEP_MEAN },
+		{ L"sweep-stdev", 1, nullptr, OPT_SWEEP_STDEV },
+		{ L"checkpoint", 1, nullptr, OPT_CHECKPOINT },
+		{ L"resume", 0, nullptr, OPT_RESUME },
+		{ L"cache", 0, nullptr, OPT_CACHE },
+		{ L"refresh-cache", 0, nullptr, OPT_REFRESH_CACHE },
+		{ L"start", 1, nullptr, OPT_START },
+		{ L"end", 1, nullptr, OPT_END },
+		{ L"memory-budget", 1, nullptr, OPT_MEMORY_BUDGET },
+		{ L"metrics", 1, nullptr, OPT_METRICS },
+		{ L"metrics-interval", 1, nullptr, OPT_METRICS_INTERVAL },
+		{ L"rendition", 1, nullptr, OPT_RENDITION },
+		{ L"daemon", 1, nullptr, OPT_DAEMON },
+		{ L"daemon-jobs", 1, nullptr, OPT_DAEMON_JOBS },
+		{ L"probesize", 1, nullptr, OPT_PROBESIZE },
+		{ L"analyzeduration", 1, nullptr, OPT_ANALYZEDURATION },
+		{ L"probe-cache", 0, nullptr, OPT_PROBE_CACHE },
+		{ L"read-ahead", 1, nullptr, OPT_READ_AHEAD },
+		{ L"read-ahead-packets", 1, nullptr, OPT_READ_AHEAD_PACKETS },
+		{ L"drop-cache", 0, nullptr, OPT_DROP_CACHE },
+		{ L"direct-io", 0, nullptr, OPT_DIRECT_IO },
+		{ L"preallocate", 0, nullptr, OPT_PREALLOCATE },
 		{ L"help", 0, nullptr, 'h' },
 		{ nullptr, 0, nullptr, 0 }
 	};
 	int option_index = 0;
+	// start the scan over, so that the daemon can parse the arguments of one job after another
+	optind = 0;
 	while ((c = getopt_long(argc, argv, L"i:o:h?", long_options, &option_index)) != -1) {
 		switch (c) {
 		case 'i':
@@ -25,6 +175,141 @@ cliopts::cliopts(int argc, wchar_t ** argv) : help(0)
 		case 'o':
 			output = optarg;
 			break;
+		case OPT_MODE:
+			mode = optarg;
+			break;
+		case OPT_SAMPLE_STEP:
+			sample_step = (int)wcstol(optarg, nullptr, 10);
+			break;
+		case OPT_SAMPLE_BUDGET:
+			sample_budget = (int)wcstol(optarg, nullptr, 10);
+			break;
+		case OPT_PACKET_PREFILTER:
+			packet_prefilter = true;
+			break;
+		case OPT_PREFILTER_VERIFY:
+			packet_prefilter = true;
+			prefilter_verify = true;
+			break;
+		case OPT_FINGERPRINT:
+			fingerprint = true;
+			break;
+		case OPT_FINGERPRINT_VERIFY:
+			fingerprint = true;
+			fingerprint_verify = true;
+			break;
+		case OPT_FINGERPRINT_GRID:
+			fingerprint = true;
+			fingerprint_grid = (int)wcstol(optarg, nullptr, 10);
+			break;
+		case OPT_REGION:
+			if (!parse_rect(optarg, region)) {
+				bad_rect = true;
+			}
+			break;
+		case OPT_AUTO_REGION:
+			auto_region = true;
+			break;
+		case OPT_EXCLUDE: {
+			bff_rect r;
+			if (parse_rect(optarg, r)) {
+				exclusions.push_back(r);
+			} else {
+				bad_rect = true;
+			}
+			break;
+		}
+		case OPT_DETECT_THREADS:
+			detect_threads = (int)wcstol(optarg, nullptr, 10);
+			break;
+		case OPT_SWEEP:
+			sweep = true;
+			break;
+		case OPT_SWEEP_Y_MAX:
+			sweep = true;
+			bad_list |= !parse_list(optarg, sweep_y_max);
+			break;
+		case OPT_SWEEP_PROPORTION:
+			sweep = true;
+			bad_list |= !parse_list(optarg, sweep_proportion);
+			break;
+		case OPT_SWEEP_MEAN:
+			sweep = true;
+			bad_list |= !parse_list(optarg, sweep_mean);
+			break;
+		case OPT_SWEEP_STDEV:
+			sweep = true;
+			bad_list |= !parse_list(optarg, sweep_stdev);
+			break;
+		case OPT_CHECKPOINT:
+			checkpoint = wcstod(optarg, nullptr);
+			break;
+		case OPT_RESUME:
+			resume = true;
+			break;
+		case OPT_CACHE:
+			cache = true;
+			break;
+		case OPT_REFRESH_CACHE:
+			cache = true;
+			refresh_cache = true;
+			break;
+		case OPT_START:
+			start = parse_time(optarg);
+			bad_time |= start < 0;
+			break;
+		case OPT_END:
+			end = parse_time(optarg);
+			bad_time |= end < 0;
+			break;
+		case OPT_MEMORY_BUDGET:
+			memory_budget = wcstod(optarg, nullptr);
+			break;
+		case OPT_METRICS:
+			metrics = optarg;
+			break;
+		case OPT_METRICS_INTERVAL:
+			metrics_interval = wcstod(optarg, nullptr);
+			break;
+		case OPT_RENDITION: {
+			bff_rendition r;
+			if (parse_rendition(optarg, r)) {
+				renditions.push_back(r);
+			} else {
+				bad_rendition = true;
+			}
+			break;
+		}
+		case OPT_DAEMON:
+			daemon = optarg;
+			break;
+		case OPT_DAEMON_JOBS:
+			daemon_jobs = (int)wcstol(optarg, nullptr, 10);
+			break;
+		case OPT_PROBESIZE:
+			probe_size = wcstod(optarg, nullptr);
+			break;
+		case OPT_ANALYZEDURATION:
+			analyze_duration = wcstod(optarg, nullptr);
+			break;
+		case OPT_PROBE_CACHE:
+			probe_cache = true;
+			break;
+		case OPT_READ_AHEAD:
+			read_ahead = wcstod(optarg, nullptr);
+			break;
+		case OPT_READ_AHEAD_PACKETS:
+			read_ahead_packets = (int)wcstol(optarg, nullptr, 10);
+			break;
+		case OPT_DROP_CACHE:
+			drop_cache = true;
+			break;
+		case OPT_DIRECT_IO:
+			direct_io = true;
+			break;
+		case OPT_PREALLOCATE:
+			preallocate = true;
+			break;
 		case 'h':
 		case '?':
 			help = true;
@@ -37,12 +322,78 @@ int cliopts::check_syntax()
 {
 	if (help) {
 		return 1;
-	} else if (input.empty()) {
+	} else if (!daemon.empty() && sweep) {
+		std::cerr << "error: --daemon cannot be combined with --sweep" << std::endl;
+		return 2;
+	} else if (daemon_jobs < 1) {
+		std::cerr << "error: --daemon-jobs must be at least 1" << std::endl;
+		return 2;
+	} else if (input.empty() && daemon.empty()) {
 		std::cerr << "error: missing required argument: --input" << std::endl;
 		return 2;
-	} else if (output.empty()) {
+	} else if (output.empty() && !sweep && daemon.empty()) {
 		std::cerr << "error: missing required argument: --output" << std::endl;
 		return 2;
+	} else if ((mode != L"substitute") && (mode != L"cut") && (mode != L"hold")) {
+		std::cerr << "error: --mode must be substitute, cut or hold" << std::endl;
+		return 2;
+	} else if (sample_step < 1) {
+		std::cerr << "error: --sample-step must be at least 1" << std::endl;
+		return 2;
+	} else if (sample_budget < 0) {
+		std::cerr << "error: --sample-budget must not be negative" << std::endl;
+		return 2;
+	} else if (fingerprint_grid < 1) {
+		std::cerr << "error: --fingerprint-grid must be at least 1" << std::endl;
+		return 2;
+	} else if (detect_threads < 0) {
+		std::cerr << "error: --detect-threads must not be negative" << std::endl;
+		return 2;
+	} else if (bad_time) {
+		std::cerr << "error: --start and --end take seconds or [hh:]mm:ss[.fff]" << std::endl;
+		return 2;
+	} else if ((end > 0) && (end <= start)) {
+		std::cerr << "error: --end must be after --start" << std::endl;
+		return 2;
+	} else if (memory_budget < 0) {
+		std::cerr << "error: --memory-budget must not be negative" << std::endl;
+		return 2;
+	} else if ((probe_size != 0) && (probe_size < 32)) {
+		std::cerr << "error: --probesize must be at least 32 bytes" << std::endl;
+		return 2;
+	} else if (read_ahead < 0) {
+		std::cerr << "error: --read-ahead must not be negative" << std::endl;
+		return 2;
+	} else if (read_ahead_packets < 1) {
+		std::cerr << "error: --read-ahead-packets must be at least 1" << std::endl;
+		return 2;
+	} else if (analyze_duration < 0) {
+		std::cerr << "error: --analyzeduration must not be negative" << std::endl;
+		return 2;
+	} else if (metrics_interval <= 0) {
+		std::cerr << "error: --metrics-interval must be positive" << std::endl;
+		return 2;
+	} else if (checkpoint < 0) {
+		std::cerr << "error: --checkpoint must not be negative" << std::endl;
+		return 2;
+	} else if ((checkpoint > 0 || resume) && (mode == L"cut")) {
+		std::cerr << "error: --checkpoint and --resume cannot be used with --mode=cut" << std::endl;
+		return 2;
+	} else if (bad_rendition) {
+		std::cerr << "error: --rendition takes WIDTHxHEIGHT,KBPS,FILE (a dimension of 0 keeps the aspect ratio; 0 kbps encodes at constant quality)" << std::endl;
+		return 2;
+	} else if (!renditions.empty() && (checkpoint > 0 || resume)) {
+		std::cerr << "error: --rendition cannot be combined with --checkpoint or --resume" << std::endl;
+		return 2;
+	} else if (bad_list) {
+		std::cerr << "error: the --sweep-... options take a comma separated list of numbers" << std::endl;
+		return 2;
+	} else if (bad_rect) {
+		std::cerr << "error: --region and --exclude take x,y,width,height (a width or height of 0 extends to the edge)" << std::endl;
+		return 2;
+	} else if (auto_region && ((region.x | region.y | region.width | region.height) != 0)) {
+		std::cerr << "error: --region and --auto-region cannot be combined" << std::endl;
+		return 2;
 	}
 	return 0;
 }
@@ -50,4 +401,44 @@ int cliopts::check_syntax()
 void cliopts::print_syntax_help()
 {
 	std::cout << "syntax: bff --input infile --output outfile options..." << std::endl;
+	std::cout << "        bff --input infile --sweep sweep-options... options..." << std::endl;
+	std::cout << "        bff --daemon=spooldir [--daemon-jobs=N]" << std::endl;
+	std::cout << "options:" << std::endl;
+	std::cout << "\t--mode=substitute|cut|hold\treplace black frames with the previous frame (default), remove them along with their audio, or extend the previous frame over them" << std::endl;
+	std::cout << "\t--sample-step=N\texamine every Nth luma row and column when detecting black frames" << std::endl;
+	std::cout << "\t--sample-budget=N\texamine at most N luma samples per frame when detecting black frames" << std::endl;
+	std::cout << "\t--packet-prefilter\tdo not scan frames whose packets are too large to be black (unvalidated; see --prefilter-verify)" << std::endl;
+	std::cout << "\t--prefilter-verify\tscan prefiltered frames anyway and report any black ones missed" << std::endl;
+	std::cout << "\t--fingerprint\treuse the previous frame's verdict when a sparse grid of luma samples is unchanged" << std::endl;
+	std::cout << "\t--fingerprint-grid=N\tsample an NxN grid for the fingerprint (default 64)" << std::endl;
+	std::cout << "\t--fingerprint-verify\tscan fingerprinted frames anyway and report any verdicts that differed" << std::endl;
+	std::cout << "\t--region=x,y,w,h\tonly examine this part of each frame when detecting black frames" << std::endl;
+	std::cout << "\t--auto-region\tignore letterbox and pillarbox bars found in the first frames with picture content" << std::endl;
+	std::cout << "\t--exclude=x,y,w,h\tnever examine this part of a frame, e.g. a burnt-in timecode or logo (repeatable)" << std::endl;
+	std::cout << "\t--detect-threads=N\tscan large frames in stripes on N threads (default: one per hardware thread; 1 disables)" << std::endl;
+	std::cout << "\t--memory-budget=MIB\tbuffer at most about MIB mebibytes of frames and packets, shortening the encoder lookahead to fit" << std::endl;
+	std::cout << "\t--metrics=FILE\trewrite FILE with the progress of the run in the Prometheus text format ..." << std::endl;
+	std::cout << "\t--metrics-interval=SECONDS\t... every SECONDS (default 10)" << std::endl;
+	std::cout << "\t--rendition=WxH,KBPS,FILE\talso write FILE scaled to WxH at KBPS kbit/s (0 = constant quality) from the same decode (repeatable)" << std::endl;
+	std::cout << "\t--probesize=BYTES\tread at most BYTES of the input to find its streams' parameters (default 5000000) ..." << std::endl;
+	std::cout << "\t--analyzeduration=SECONDS\t... and at most SECONDS of it (default 5)" << std::endl;
+	std::cout << "\t--probe-cache\tremember the streams' parameters beside the input and skip probing when it is opened again" << std::endl;
+	std::cout << "\t--read-ahead=MIB\tread the input on its own thread up to MIB mebibytes ahead of decoding ..." << std::endl;
+	std::cout << "\t--read-ahead-packets=N\t... and at most N packets ahead (default 8192)" << std::endl;
+	std::cout << "\t--drop-cache\tdrop the output from the page cache as it is written back (Linux)" << std::endl;
+	std::cout << "\t--direct-io\twrite the output with O_DIRECT, bypassing the page cache (Linux)" << std::endl;
+	std::cout << "\t--preallocate\treserve disk space for the output up front, as much as the input takes (Linux)" << std::endl;
+	std::cout << "\t--start=TIME\tfilter only from this time (seconds or [hh:]mm:ss[.fff]) ..." << std::endl;
+	std::cout << "\t--end=TIME\t... up to this time; the output holds only the range filtered" << std::endl;
+	std::cout << "\t--checkpoint=SECONDS\tsave a checkpoint after about every SECONDS of video so that an interrupted run can be resumed" << std::endl;
+	std::cout << "\t--resume\tcontinue an interrupted run from its checkpoint, if there is one" << std::endl;
+	std::cout << "\t--cache\treuse the black frame verdicts of an earlier run of the same input and detector settings" << std::endl;
+	std::cout << "\t--refresh-cache\tdetect every frame again and rewrite the cached verdicts" << std::endl;
+	std::cout << "\t--daemon=DIR\trun the jobs dropped into DIR as NAME.job files (one argument per line) until DIR/stop is created" << std::endl;
+	std::cout << "\t--daemon-jobs=N\trun up to N jobs at once (default 1)" << std::endl;
+	std::cout << "sweep options (decode once and report the black frames found with each combination of settings):" << std::endl;
+	std::cout << "\t--sweep-y-max=N,...\tluma levels at or below which a pixel is black (default 17)" << std::endl;
+	std::cout << "\t--sweep-proportion=P,...\tproportions of black pixels making a black frame (default 0.86)" << std::endl;
+	std::cout << "\t--sweep-mean=M,...\tstatistical detector: highest mean luma of a black frame" << std::endl;
+	std::cout << "\t--sweep-stdev=S,...\tstatistical detector: highest luma standard deviation of a black frame" << std::endl;
 }
\ No newline at end of file
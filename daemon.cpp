@@ -0,0 +1,390 @@
+/*	bff - Black Frame Filter for FFmpeg
+	Copyright (C) 2017 Michael Trenholm-Boyle.
+	This software is redistributable under a permissive open source license.
+	See the LICENSE file for further information. */
+#include "stdafx.h"
+
+#include "bff.h"
+
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#ifndef _WIN32
+#include <dirent.h>
+#include <signal.h>
+#endif
+#ifndef S_ISDIR
+#define S_ISDIR(mode) (((mode) & S_IFMT) == S_IFDIR)
+#endif
+
+
+// a job file NAME.job in the spool directory holds the arguments of one run, one per line; the daemon claims it by
+// renaming it NAME@HOST-PID.running, naming itself as the owner, keeps NAME.status up to date while it runs, and
+// renames it NAME.done or NAME.failed after
+static const char * const job_ext = ".job";
+static const char * const running_ext = ".running";
+static const char * const done_ext = ".done";
+static const char * const failed_ext = ".failed";
+static const char * const status_ext = ".status";
+// creating this file in the spool directory stops every daemon sharing it once the jobs each is running have finished;
+// it is left for them all to see, and a daemon will not start while it is there
+static const char * const stop_name = "stop";
+
+// a claimed job, waiting for or running in a slot
+struct spool_job
+{
+	std::string name;
+	std::string input;
+	std::string output;
+	bff_options options;
+};
+
+static std::mutex log_mutex;
+
+static void log_line(const std::string & line)
+{
+	std::lock_guard<std::mutex> lock(log_mutex);
+	std::cout << line << std::endl;
+}
+
+// replaces to with from, as rename() does on POSIX
+static bool replace_file(const std::string & from, const std::string & to)
+{
+#ifdef _WIN32
+	remove(to.c_str());
+#endif
+	return rename(from.c_str(), to.c_str()) == 0;
+}
+
+// the name of this host and the id of this process, which together identify a daemon's claims
+static std::string this_daemon()
+{
+	char host[256] = { 0 };
+#ifdef _WIN32
+	DWORD size = sizeof(host);
+	if (!GetComputerNameA(host, &size)) {
+		host[0] = 0;
+	}
+	unsigned long pid = GetCurrentProcessId();
+#else
+	if (gethostname(host, sizeof(host) - 1) != 0) {
+		host[0] = 0;
+	}
+	unsigned long pid = (unsigned long)getpid();
+#endif
+	std::string name = host[0] ? host : "localhost";
+	std::replace(name.begin(), name.end(), '@', '_');
+	return name + "-" + std::to_string(pid);
+}
+
+// true if a process with this id is running on this host
+static bool process_alive(unsigned long pid)
+{
+#ifdef _WIN32
+	HANDLE h = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)pid);
+	if (!h) {
+		return GetLastError() == ERROR_ACCESS_DENIED;
+	}
+	DWORD code = 0;
+	bool alive = GetExitCodeProcess(h, &code) && (code == STILL_ACTIVE);
+	CloseHandle(h);
+	return alive;
+#else
+	return (kill((pid_t)pid, 0) == 0) || (errno == EPERM);
+#endif
+}
+
+// the names, less the extension, of the files in dir whose names end in ext, in order
+static std::vector<std::string> list_files(const std::string & dir, const std::string & ext)
+{
+	std::vector<std::string> files;
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	HANDLE h = FindFirstFileA((dir + "\\*" + ext).c_str(), &fd);
+	if (h != INVALID_HANDLE_VALUE) {
+		do {
+			files.push_back(fd.cFileName);
+		} while (FindNextFileA(h, &fd));
+		FindClose(h);
+	}
+#else
+	DIR * d = opendir(dir.c_str());
+	if (d) {
+		while (struct dirent * e = readdir(d)) {
+			files.push_back(e->d_name);
+		}
+		closedir(d);
+	}
+#endif
+	std::vector<std::string> names;
+	for (const std::string & f : files) {
+		if ((f.size() > ext.size()) && (f.compare(f.size() - ext.size(), ext.size(), ext) == 0)) {
+			names.push_back(f.substr(0, f.size() - ext.size()));
+		}
+	}
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+// reads the arguments in a job file; blank lines and lines starting with # are skipped
+static bool read_job(const std::string & fname, std::vector<std::wstring> & args)
+{
+	std::ifstream in(fname.c_str(), std::ios::binary);
+	if (!in) {
+		return false;
+	}
+	std::string line;
+	while (std::getline(in, line)) {
+		size_t first = line.find_first_not_of(" \t\r");
+		if ((first == std::string::npos) || (line[first] == '#')) {
+			continue;
+		}
+		size_t last = line.find_last_not_of(" \t\r");
+		args.push_back(utf8(line.substr(first, last - first + 1)));
+	}
+	return true;
+}
+
+class spool
+{
+private:
+	std::string _dir;
+	// this daemon's HOST-PID, recorded in the name of each job it claims
+	std::string _owner;
+	int _slots;
+	std::vector<std::thread> _threads;
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	std::deque<spool_job> _jobs;
+	// jobs claimed and not yet finished
+	int _claimed;
+	bool _stopping;
+	std::string path(const std::string & name, const char * ext) const
+	{
+		return _dir + "/" + name + ext;
+	}
+	// the file of a job while this daemon has it
+	std::string claimed_path(const std::string & name) const
+	{
+		return path(name + "@" + _owner, running_ext);
+	}
+	void requeue_abandoned();
+	void write_status(const std::string & name, const char * state, const bff_stats & stats, const std::string & error);
+	void finish(const std::string & name, bool ok, const bff_stats & stats, const std::string & error);
+	void claim(const std::string & name);
+	void run_job(const spool_job & job);
+	void work();
+public:
+	spool(const std::string & dir, int slots);
+	~spool();
+	int run();
+};
+
+spool::spool(const std::string & dir, int slots) : _dir(dir), _owner(this_daemon()), _slots(slots), _claimed(0), _stopping(false)
+{
+}
+
+spool::~spool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stopping = true;
+		_changed.notify_all();
+	}
+	for (std::thread & t : _threads) {
+		t.join();
+	}
+}
+
+// replaces a job's status file atomically, so that a reader never sees it half written
+void spool::write_status(const std::string & name, const char * state, const bff_stats & stats, const std::string & error)
+{
+	std::ostringstream out;
+	out << "state=" << state << "\n";
+	out << "updated=" << (int64_t)time(nullptr) << "\n";
+	out << "video_frames=" << stats.video_frame_count << "\n";
+	out << "black_frames=" << stats.black_frame_count << "\n";
+	out << "audio_frames=" << stats.audio_frame_count << "\n";
+	if (!error.empty()) {
+		std::string message = error;
+		std::replace(message.begin(), message.end(), '\n', ' ');
+		out << "error=" << message << "\n";
+	}
+	write_file_atomically(path(name, status_ext), out.str());
+}
+
+// records the outcome of a claimed job and frees its slot
+void spool::finish(const std::string & name, bool ok, const bff_stats & stats, const std::string & error)
+{
+	write_status(name, ok ? "done" : "failed", stats, error);
+	replace_file(claimed_path(name), path(name, ok ? done_ext : failed_ext));
+	if (ok) {
+		log_line("info:\tjob " + name + " done: " + std::to_string(stats.black_frame_count) + " of " + std::to_string(stats.video_frame_count) + " frames black");
+	} else {
+		log_line("error:\tjob " + name + " failed: " + error);
+	}
+	std::lock_guard<std::mutex> lock(_mutex);
+	--_claimed;
+	_changed.notify_all();
+}
+
+// takes a job file for this daemon and queues it for a slot; the rename fails if another daemon took it first, and
+// names this daemon as the owner in the same step.
+// the arguments are parsed here, on the one thread that polls the spool, because the option parser is not reentrant
+void spool::claim(const std::string & name)
+{
+	if (rename(path(name, job_ext).c_str(), claimed_path(name).c_str()) != 0) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		++_claimed;
+	}
+	std::vector<std::wstring> args(1, L"bff");
+	if (!read_job(claimed_path(name), args)) {
+		finish(name, false, bff_stats(), "the job file cannot be read");
+		return;
+	}
+	std::vector<wchar_t *> argv;
+	for (std::wstring & arg : args) {
+		argv.push_back(&arg[0]);
+	}
+	argv.push_back(nullptr);
+	cliopts opts((int)args.size(), argv.data());
+	if (opts.sweep || !opts.daemon.empty()) {
+		finish(name, false, bff_stats(), "--sweep and --daemon cannot be spooled");
+		return;
+	} else if (opts.check_syntax()) {
+		finish(name, false, bff_stats(), "invalid arguments");
+		return;
+	}
+	spool_job job;
+	job.name = name;
+	job.input = ansi(opts.input);
+	job.output = ansi(opts.output);
+	job.options = pipeline_options(opts);
+	write_status(name, "queued", bff_stats(), std::string());
+	std::lock_guard<std::mutex> lock(_mutex);
+	_jobs.push_back(job);
+	_changed.notify_all();
+}
+
+void spool::run_job(const spool_job & job)
+{
+	log_line("info:\tjob " + job.name + " started: " + job.input + " -> " + job.output);
+	bff_stats last;
+	try {
+		bff_pipeline pipeline(job.options);
+		pipeline.on_progress([this, &job, &last](const bff_stats & stats) {
+			last = stats;
+			write_status(job.name, "running", stats, std::string());
+		});
+		write_status(job.name, "running", last, std::string());
+		bff_stats stats = pipeline.process(job.input, job.output);
+		finish(job.name, true, stats, std::string());
+	} catch (const std::exception & e) {
+		finish(job.name, false, last, e.what());
+	}
+}
+
+// a slot: runs queued jobs one after another on the same thread, so that the thread's detection workers stay warm
+void spool::work()
+{
+	while (true) {
+		spool_job job;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_changed.wait(lock, [this]() {
+				return _stopping || !_jobs.empty();
+			});
+			if (_jobs.empty()) {
+				return;
+			}
+			job = _jobs.front();
+			_jobs.pop_front();
+		}
+		run_job(job);
+	}
+}
+
+// requeues the jobs claimed by daemons on this host that are no longer running, e.g. after a crash; the claims of
+// running daemons, and of daemons on other hosts, which cannot be checked from here, are left alone
+void spool::requeue_abandoned()
+{
+	std::string host = _owner.substr(0, _owner.rfind('-'));
+	for (const std::string & claim : list_files(_dir, running_ext)) {
+		size_t at = claim.rfind('@'), dash = claim.rfind('-');
+		if ((at == std::string::npos) || (dash == std::string::npos) || (dash < at)) {
+			log_line("warn:\t" + path(claim, running_ext) + " names no owner and has been left alone");
+			continue;
+		}
+		std::string name = claim.substr(0, at);
+		std::string claim_host = claim.substr(at + 1, dash - at - 1);
+		unsigned long pid = strtoul(claim.c_str() + dash + 1, nullptr, 10);
+		if (claim_host != host) {
+			log_line("info:\tjob " + name + " is claimed by a daemon on " + claim_host + " and has been left alone");
+			continue;
+		}
+		// a claim naming this process's id was left by an earlier daemon that happened to have the same id
+		if ((claim.substr(at + 1) != _owner) && process_alive(pid)) {
+			continue;
+		}
+		if (rename(path(claim, running_ext).c_str(), path(name, job_ext).c_str()) == 0) {
+			log_line("warn:\tjob " + name + " was interrupted and has been requeued");
+		}
+	}
+}
+
+// polls the spool about once a second, claiming no more jobs than there are idle slots so that the rest stay
+// available to other daemons sharing the directory, until the stop file appears
+int spool::run()
+{
+	struct stat st = {};
+	if ((stat(_dir.c_str(), &st) != 0) || !S_ISDIR(st.st_mode)) {
+		throw ffmpeg_error(AVERROR(ENOENT), "bff_daemon", _dir.c_str());
+	}
+	// removing it could let through a daemon still running that has not yet polled for it
+	std::string stop_file = path(stop_name, "");
+	if (stat(stop_file.c_str(), &st) == 0) {
+		throw ffmpeg_error(AVERROR(EEXIST), "bff_daemon", stop_file.c_str());
+	}
+	// jobs left running by a daemon that did not stop cleanly are run again from the start
+	requeue_abandoned();
+	for (int i = 0; i < _slots; ++i) {
+		_threads.push_back(std::thread(&spool::work, this));
+	}
+	log_line("info:\twatching " + _dir + " for jobs on " + std::to_string(_slots) + " slot(s); create " + stop_file + " to stop");
+	while (stat(stop_file.c_str(), &st) != 0) {
+		int idle;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			idle = _slots - _claimed;
+		}
+		if (idle > 0) {
+			std::vector<std::string> names = list_files(_dir, job_ext);
+			for (size_t i = 0; (i < names.size()) && (i < (size_t)idle); ++i) {
+				claim(names[i]);
+			}
+		}
+		std::unique_lock<std::mutex> lock(_mutex);
+		_changed.wait_for(lock, std::chrono::seconds(1));
+	}
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		log_line("info:\tstopping once " + std::to_string(_claimed) + " running job(s) have finished");
+		_stopping = true;
+		_changed.notify_all();
+	}
+	for (std::thread & t : _threads) {
+		t.join();
+	}
+	_threads.clear();
+	return 0;
+}
+
+int bff_daemon(const cliopts & opts)
+{
+	spool s(ansi(opts.daemon), opts.daemon_jobs);
+	return s.run();
+}
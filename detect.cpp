@@ -0,0 +1,589 @@
+/*	bff - Black Frame Filter for FFmpeg
+	Copyright (C) 2017 Michael Trenholm-Boyle.
+	This software is redistributable under a permissive open source license.
+	See the LICENSE file for further information. */
+#include "stdafx.h"
+
+#include "bff.h"
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
+
+#include <vector>
+
+// a luma sample layout: Depth significant bits stored in a T, shifted left by Shift bits (e.g. P010 is MSB-aligned)
+template <typename T, int Depth, int Shift = 0>
+struct luma_format
+{
+	typedef T sample_type;
+	static const int depth = Depth;
+	static const int shift = Shift;
+	// one 8-bit luma step in histogram levels
+	static const int unit = 1 << (Depth - 8);
+	// scales an 8-bit luma level to this format, including the levels that round down to it
+	static int scale(int y8)
+	{
+		return ((y8 + 1) << (Depth - 8 + Shift)) - 1;
+	}
+	// the highest histogram level that rounds down to an 8-bit luma level
+	static int scale_level(int y8)
+	{
+		return ((y8 + 1) << (Depth - 8)) - 1;
+	}
+	// the histogram level of a sample; out of range samples count as the brightest level
+	static int level(T y)
+	{
+		return std::min<int>(y >> Shift, (1 << Depth) - 1);
+	}
+};
+
+typedef luma_format<uint8_t, 8> luma8;
+typedef luma_format<uint16_t, 9> luma9;
+typedef luma_format<uint16_t, 10> luma10;
+typedef luma_format<uint16_t, 12> luma12;
+typedef luma_format<uint16_t, 16> luma16;
+typedef luma_format<uint16_t, 10, 6> luma_p010;
+typedef luma_format<uint16_t, 12, 4> luma_p012;
+
+// the pixels the detectors examine: a rectangle of the frame less any excluded rectangles
+class luma_area
+{
+private:
+	int _x0, _y0, _x1, _y1;
+	const std::vector<bff_rect> & _exclusions;
+public:
+	luma_area(const AVFrame * frame, const bff_rect & region, const std::vector<bff_rect> & exclusions) : _exclusions(exclusions)
+	{
+		_x0 = std::min(std::max(region.x, 0), frame->width);
+		_y0 = std::min(std::max(region.y, 0), frame->height);
+		_x1 = region.width > 0 ? std::min(_x0 + region.width, frame->width) : frame->width;
+		_y1 = region.height > 0 ? std::min(_y0 + region.height, frame->height) : frame->height;
+	}
+	int left() const
+	{
+		return _x0;
+	}
+	int right() const
+	{
+		return _x1;
+	}
+	int top() const
+	{
+		return _y0;
+	}
+	int bottom() const
+	{
+		return _y1;
+	}
+	int64_t pixels() const
+	{
+		return (int64_t)(_x1 - _x0) * (_y1 - _y0);
+	}
+	// the half-open column spans of row y to examine
+	void spans(int y, std::vector<std::pair<int, int>> & out) const
+	{
+		out.clear();
+		out.push_back(std::make_pair(_x0, _x1));
+		for (const bff_rect & r : _exclusions) {
+			if ((y < r.y) || ((r.height > 0) && (y >= r.y + r.height))) {
+				continue;
+			}
+			int a = r.x, b = r.width > 0 ? r.x + r.width : INT_MAX;
+			for (size_t i = out.size(); i-- > 0; ) {
+				std::pair<int, int> span = out[i];
+				if ((b <= span.first) || (a >= span.second)) {
+					continue;
+				}
+				out.erase(out.begin() + i);
+				if (b < span.second) {
+					out.insert(out.begin() + i, std::make_pair(b, span.second));
+				}
+				if (a > span.first) {
+					out.insert(out.begin() + i, std::make_pair(span.first, a));
+				}
+			}
+		}
+	}
+};
+
+// runs tasks on the workers, if any, or else in turn on this thread
+static void workers_run(worker_pool * workers, int tasks, const std::function<void(int)> & task)
+{
+	if (workers) {
+		workers->run(tasks, task);
+	} else {
+		for (int i = 0; i < tasks; ++i) {
+			task(i);
+		}
+	}
+}
+
+// the first multiple of step, offset by step / 2, at or after x
+static int first_sample(int x, int step)
+{
+	int phase = step / 2;
+	return x <= phase ? phase : x + (step - ((x - phase) % step)) % step;
+}
+
+// counts the samples of sampled rows [r0, r1) of the area by level
+template <typename F>
+static void luma_histogram_rows(const uint8_t * Y, int linesize, const luma_area & area, int step, int r0, int r1, uint32_t * counts)
+{
+	std::vector<std::pair<int, int>> spans;
+	int y0 = first_sample(area.top(), step);
+	for (int r = r0; r < r1; ++r) {
+		int y = y0 + r * step;
+		const typename F::sample_type * row = (const typename F::sample_type *)(Y + y * linesize);
+		area.spans(y, spans);
+		for (const std::pair<int, int> & span : spans) {
+			for (int x = first_sample(span.first, step); x < span.second; x += step) {
+				++counts[F::level(row[x])];
+			}
+		}
+	}
+}
+
+// builds the histogram of the luma samples in the area in a single pass over the plane;
+// with step > 1 only the centre of each step x step cell of the frame is sampled.
+// given workers and at least parallel_min samples to examine, horizontal stripes are counted in parallel
+template <typename F>
+static void scan_luma_histogram(const AVFrame * frame, const luma_area & area, int step, worker_pool * workers, int64_t parallel_min, luma_histogram & histogram)
+{
+	const int levels = 1 << F::depth;
+	int y0 = first_sample(area.top(), step);
+	int rows = y0 < area.bottom() ? (area.bottom() - y0 + step - 1) / step : 0;
+	int stripes = 1;
+	if (workers && (workers->size() > 1) && (area.pixels() / ((int64_t)step * step) >= parallel_min)) {
+		// a few stripes per worker even out the load; each stripe keeps at least 16 rows and all their counts fit in 4 MiB
+		stripes = std::max(std::min(std::min(workers->size() * 4, (1 << 20) / levels), rows / 16), 1);
+	}
+	// the counts of each stripe are a cache line apart so that no two workers ever share one
+	size_t stride = ((levels + 15) & ~15) + 16;
+	std::vector<uint32_t> partial(stripes * stride);
+	workers_run(workers, stripes, [&](int i) {
+		luma_histogram_rows<F>(frame->data[0], frame->linesize[0], area, step, (int)((int64_t)rows * i / stripes), (int)((int64_t)rows * (i + 1) / stripes), &partial[i * stride]);
+	});
+	histogram.reset(F::depth);
+	for (int i = 0; i < stripes; ++i) {
+		histogram.add(&partial[i * stride]);
+	}
+}
+
+// the thresholds are given on the 8-bit scale and are scaled to the histogram's levels by the format's constants
+template <typename F>
+static bool is_statistically_black_frame(const luma_histogram & histogram, const bff_detector_options & opts)
+{
+	double mean = 0, stdev = 0;
+	histogram.statistics(nullptr, nullptr, &mean, &stdev);
+	return (histogram.samples() > 0) && (mean <= opts.mean_threshold * F::unit) && (stdev <= opts.stdev_threshold * F::unit);
+}
+
+template <typename F>
+static bool is_proportionally_black_frame(const luma_histogram & histogram, const bff_detector_options & opts)
+{
+	return (histogram.samples() > 0) && (histogram.proportion_at_or_below(F::scale_level(opts.y_max)) >= opts.proportion_threshold);
+}
+
+// true if the proportional verdict of a sampled histogram can be trusted without a full scan:
+// the sampled proportion lies more than sample_error_z standard errors (plus one sample) from the threshold
+template <typename F>
+static bool is_decisive_sample(const luma_histogram & histogram, const bff_detector_options & opts)
+{
+	double n = (double)histogram.samples();
+	if (n == 0) {
+		return false;
+	}
+	double proportion = histogram.proportion_at_or_below(F::scale_level(opts.y_max));
+	double margin = opts.sample_error_z * sqrt(proportion * (1 - proportion) / n) + 1 / n;
+	return fabs(proportion - opts.proportion_threshold) > margin;
+}
+
+// the sampling step for an area: the configured step, widened so that no more than sample_budget samples are taken
+static int sample_step(const luma_area & area, const bff_detector_options & opts)
+{
+	int step = std::max(opts.sample_step, 1);
+	if (opts.sample_budget > 0) {
+		double pixels = (double)area.pixels();
+		if (pixels > opts.sample_budget) {
+			step = std::max(step, (int)ceil(sqrt(pixels / opts.sample_budget)));
+		}
+	}
+	return step;
+}
+
+// the verdict of the configured detector on a histogram of samples in format F
+template <typename F>
+static bool is_black_frame(const luma_histogram & histogram, const bff_detector_options & opts)
+{
+	if (opts.detection == bff_detection::statistical) {
+		return is_statistically_black_frame<F>(histogram, opts);
+	}
+	return is_proportionally_black_frame<F>(histogram, opts);
+}
+
+// every detector works from the one histogram, so detection is a single pass over the plane
+// (two when a sampled histogram is too close to call)
+template <typename F>
+static bool is_black_frame(AVFrame * frame, const bff_detector_options & opts, worker_pool * workers)
+{
+	luma_area area(frame, opts.region, opts.exclusions);
+	luma_histogram histogram;
+	// only the proportional detector can judge from a sample
+	int step = opts.detection == bff_detection::proportional ? sample_step(area, opts) : 1;
+	if (step > 1) {
+		scan_luma_histogram<F>(frame, area, step, workers, opts.parallel_min_samples, histogram);
+	}
+	if ((step == 1) || !is_decisive_sample<F>(histogram, opts)) {
+		scan_luma_histogram<F>(frame, area, 1, workers, opts.parallel_min_samples, histogram);
+	}
+	return is_black_frame<F>(histogram, opts);
+}
+
+// FNV-1a over the samples of a grid x grid lattice spread evenly over the area, skipping the excluded parts, and the
+// area's bounds; identical frames always match, and frames differing anywhere on the lattice almost never do
+template <typename F>
+static uint64_t frame_fingerprint(const AVFrame * frame, const luma_area & area, int grid)
+{
+	typedef typename F::sample_type sample_type;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	auto mix = [&hash](uint64_t v) {
+		hash = (hash ^ v) * 0x100000001b3ULL;
+	};
+	mix(area.left());
+	mix(area.top());
+	mix(area.right());
+	mix(area.bottom());
+	int width = area.right() - area.left(), height = area.bottom() - area.top();
+	if ((width <= 0) || (height <= 0)) {
+		return hash;
+	}
+	std::vector<std::pair<int, int>> spans;
+	for (int i = 0; i < grid; ++i) {
+		int y = area.top() + (int)((2 * i + 1) * (int64_t)height / (2 * grid));
+		const sample_type * row = (const sample_type *)(frame->data[0] + y * frame->linesize[0]);
+		area.spans(y, spans);
+		for (int j = 0; j < grid; ++j) {
+			int x = area.left() + (int)((2 * j + 1) * (int64_t)width / (2 * grid));
+			for (const std::pair<int, int> & span : spans) {
+				if ((x >= span.first) && (x < span.second)) {
+					mix(row[x]);
+					break;
+				}
+			}
+		}
+	}
+	return hash;
+}
+
+// the bounding rectangle of the luma samples brighter than y_max (on the 8-bit scale); empty if there are none
+template <typename F>
+static bff_rect picture_bounds(const AVFrame * frame, int y_max)
+{
+	typedef typename F::sample_type sample_type;
+	int lim = F::scale(y_max);
+	int x0 = frame->width, y0 = frame->height, x1 = 0, y1 = 0;
+	for (int y = 0; y < frame->height; ++y) {
+		const sample_type * row = (const sample_type *)(frame->data[0] + y * frame->linesize[0]);
+		int first = -1, last = -1;
+		for (int x = 0; x < frame->width; ++x) {
+			if (row[x] > lim) {
+				first = x;
+				break;
+			}
+		}
+		if (first < 0) {
+			continue;
+		}
+		for (int x = frame->width; x-- > first; ) {
+			if (row[x] > lim) {
+				last = x;
+				break;
+			}
+		}
+		x0 = std::min(x0, first);
+		x1 = std::max(x1, last + 1);
+		y0 = std::min(y0, y);
+		y1 = y + 1;
+	}
+	bff_rect r;
+	if (x1 > x0) {
+		r.x = x0;
+		r.y = y0;
+		r.width = x1 - x0;
+		r.height = y1 - y0;
+	}
+	return r;
+}
+
+// the luma_format specialisation that reads plane 0 of a pixel format in place, as (depth << 8) | shift; 0 if there is none
+static int luma_layout(int format)
+{
+	const AVPixFmtDescriptor * desc = av_pix_fmt_desc_get((AVPixelFormat)format);
+	if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_BE | AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL))) {
+		return 0;
+	}
+	// luma must be alone in plane 0 (planar YUV, NV12/NV21, P010/P016 and grey)
+	const AVComponentDescriptor & luma = desc->comp[0];
+	if ((luma.plane != 0) || (luma.offset != 0)) {
+		return 0;
+	}
+	int layout = (luma.depth << 8) | luma.shift;
+	if ((luma.step == 1) && (layout == (8 << 8))) {
+		return layout;
+	} else if (luma.step == 2) {
+		switch (layout) {
+		case (9 << 8) | 0:
+		case (10 << 8) | 0:
+		case (12 << 8) | 0:
+		case (16 << 8) | 0:
+		case (10 << 8) | 6:
+		case (12 << 8) | 4:
+			return layout;
+		}
+	}
+	return 0;
+}
+
+// calls kernel with a value of the luma_format type matching the frame's pixel format
+template <typename Kernel>
+static auto with_luma_format(const AVFrame * frame, Kernel kernel) -> decltype(kernel(luma8()))
+{
+	switch (luma_layout(frame->format)) {
+	case (8 << 8) | 0:
+		return kernel(luma8());
+	case (9 << 8) | 0:
+		return kernel(luma9());
+	case (10 << 8) | 0:
+		return kernel(luma10());
+	case (12 << 8) | 0:
+		return kernel(luma12());
+	case (16 << 8) | 0:
+		return kernel(luma16());
+	case (10 << 8) | 6:
+		return kernel(luma_p010());
+	case (12 << 8) | 4:
+		return kernel(luma_p012());
+	}
+	throw ffmpeg_error(AVERROR(ENOSYS), "luma_layout", av_get_pix_fmt_name((AVPixelFormat)frame->format));
+}
+
+// calls kernel with a value of a luma_format type of the histogram's depth; its levels are already shifted down
+template <typename Kernel>
+static auto with_luma_depth(const luma_histogram & histogram, Kernel kernel) -> decltype(kernel(luma8()))
+{
+	switch (histogram.depth()) {
+	case 8:
+		return kernel(luma8());
+	case 9:
+		return kernel(luma9());
+	case 10:
+		return kernel(luma10());
+	case 12:
+		return kernel(luma12());
+	case 16:
+		return kernel(luma16());
+	}
+	throw ffmpeg_error(AVERROR(ENOSYS), "luma_histogram", "depth");
+}
+
+bool is_black_frame_supported(int format)
+{
+	return luma_layout(format) != 0;
+}
+
+// the full histogram of the region of interest of a frame
+void scan_luma_histogram(AVFrame * frame, const bff_detector_options & opts, worker_pool * workers, luma_histogram & histogram)
+{
+	with_luma_format(frame, [frame, &opts, workers, &histogram](auto format) {
+		luma_area area(frame, opts.region, opts.exclusions);
+		scan_luma_histogram<decltype(format)>(frame, area, 1, workers, opts.parallel_min_samples, histogram);
+	});
+}
+
+// the verdict of the configured detector on a histogram; only the thresholds of opts are used
+bool is_black_frame(const luma_histogram & histogram, const bff_detector_options & opts)
+{
+	return with_luma_depth(histogram, [&histogram, &opts](auto format) {
+		return is_black_frame<decltype(format)>(histogram, opts);
+	});
+}
+
+bool is_black_frame(AVFrame * frame, const bff_detector_options & opts, worker_pool * workers)
+{
+	return with_luma_format(frame, [frame, &opts, workers](auto format) {
+		return is_black_frame<decltype(format)>(frame, opts, workers);
+	});
+}
+
+uint64_t frame_fingerprint(const AVFrame * frame, const bff_detector_options & opts)
+{
+	return with_luma_format(frame, [frame, &opts](auto format) {
+		luma_area area(frame, opts.region, opts.exclusions);
+		return frame_fingerprint<decltype(format)>(frame, area, std::max(opts.fingerprint_grid, 1));
+	});
+}
+
+
+// observes a frame with picture content, widening the area known to contain picture; returns true once settled
+bool letterbox_detector::observe(const AVFrame * frame)
+{
+	if (settled()) {
+		return true;
+	}
+	bff_rect bounds = with_luma_format(frame, [frame, this](auto format) {
+		return picture_bounds<decltype(format)>(frame, _y_max);
+	});
+	if (bounds.width == 0) {
+		// a black frame says nothing about where the bars are
+		return false;
+	}
+	if (_frames == 0) {
+		_area = bounds;
+	} else {
+		int x1 = std::max(_area.x + _area.width, bounds.x + bounds.width);
+		int y1 = std::max(_area.y + _area.height, bounds.y + bounds.height);
+		_area.x = std::min(_area.x, bounds.x);
+		_area.y = std::min(_area.y, bounds.y);
+		_area.width = x1 - _area.x;
+		_area.height = y1 - _area.y;
+	}
+	++_frames;
+	return settled();
+}
+
+
+void luma_histogram::reset(int depth)
+{
+	_depth = depth;
+	_samples = 0;
+	_counts.assign((size_t)1 << depth, 0);
+}
+
+void luma_histogram::add(const uint32_t * counts)
+{
+	for (size_t i = 0; i < _counts.size(); ++i) {
+		_counts[i] += counts[i];
+		_samples += counts[i];
+	}
+}
+
+// the number of samples at or below a level
+uint64_t luma_histogram::at_or_below(int level) const
+{
+	if (level < 0) {
+		return 0;
+	}
+	size_t lim = std::min((size_t)level + 1, _counts.size());
+	uint64_t n = 0;
+	for (size_t i = 0; i < lim; ++i) {
+		n += _counts[i];
+	}
+	return n;
+}
+
+double luma_histogram::proportion_at_or_below(int level) const
+{
+	return _samples ? at_or_below(level) / (double)_samples : 0;
+}
+
+// luma range, mean and standard deviation in levels
+void luma_histogram::statistics(double * range_min, double * range_max, double * mean, double * stdev) const
+{
+	if (_samples == 0) {
+		return;
+	}
+	size_t m = _counts.size(), M = 0;
+	double S = 0;
+	for (size_t i = 0; i < _counts.size(); ++i) {
+		if (_counts[i]) {
+			m = std::min(m, i);
+			M = i;
+			S += (double)i * _counts[i];
+		}
+	}
+	S /= _samples;
+	double V = 0;
+	for (size_t i = m; i <= M; ++i) {
+		V += pow(i - S, 2) * _counts[i];
+	}
+	V = sqrt(V / _samples);
+	if (range_min) {
+		*range_min = (double)m;
+	}
+	if (range_max) {
+		*range_max = (double)M;
+	}
+	if (mean) {
+		*mean = S;
+	}
+	if (stdev) {
+		*stdev = V;
+	}
+}
+
+
+
+packet_size_prefilter::picture_type_sizes & packet_size_prefilter::sizes(const AVFrame * frame)
+{
+	int type = frame->pict_type;
+	return _types[(type >= 0 && type < 8) ? type : 0];
+}
+
+void packet_size_prefilter::sent(const AVPacket * packet)
+{
+	if (!packet || ((packet->pts == AV_NOPTS_VALUE) && (packet->dts == AV_NOPTS_VALUE))) {
+		return;
+	}
+	sent_packet p = { packet->pts, packet->dts, packet->size };
+	_pending.push_back(p);
+	if (_pending.size() > pending_max) {
+		_pending.pop_front();
+	}
+}
+
+// the decoder's best effort timestamp is the packet's pts where it has one, and otherwise its dts
+int packet_size_prefilter::size_of(const AVFrame * frame)
+{
+	int64_t ts = frame->best_effort_timestamp;
+	if (ts == AV_NOPTS_VALUE) {
+		return -1;
+	}
+	auto match = std::find_if(_pending.begin(), _pending.end(), [ts](const sent_packet & p) {
+		return p.pts == ts;
+	});
+	if (match == _pending.end()) {
+		match = std::find_if(_pending.begin(), _pending.end(), [ts](const sent_packet & p) {
+			return p.dts == ts;
+		});
+	}
+	if (match == _pending.end()) {
+		return -1;
+	}
+	int size = match->size;
+	_pending.erase(match);
+	return size;
+}
+
+// only the black frames of a picture type bound the sizes of its black packets: until one has been scanned, nothing
+// is ruled out, as a black frame cut into moving content can code to a packet as large as its neighbours
+bool packet_size_prefilter::could_be_black(const AVFrame * frame, int size)
+{
+	picture_type_sizes & t = sizes(frame);
+	if ((size <= 0) || (t.seen < (uint64_t)_opts.prefilter_warmup) || (t.black_max <= 0)) {
+		return true;
+	}
+	return size <= t.black_max * _opts.prefilter_factor;
+}
+
+void packet_size_prefilter::learn(const AVFrame * frame, int size, bool black)
+{
+	if (size <= 0) {
+		return;
+	}
+	picture_type_sizes & t = sizes(frame);
+	++t.seen;
+	if (black && (size > t.black_max)) {
+		t.black_max = size;
+	}
+}
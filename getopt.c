@@ -575,7 +575,11 @@ static const wchar_t *_getopt_initialize_w (const wchar_t *optstring, struct _ge
 {
 	d->__first_nonopt = d->__last_nonopt = d->optind;
 	d->__nextchar = NULL;
+#ifdef _WIN32
 	d->__posixly_correct = posixly_correct | !!_wgetenv(L"POSIXLY_CORRECT");
+#else
+	d->__posixly_correct = posixly_correct | !!getenv("POSIXLY_CORRECT");
+#endif
 	if (optstring[0] == L'-')
 	{
 		d->__ordering = RETURN_IN_ORDER;
@@ -0,0 +1,536 @@
+/*	bff - Black Frame Filter for FFmpeg
+	Copyright (C) 2017 Michael Trenholm-Boyle.
+	This software is redistributable under a permissive open source license.
+	See the LICENSE file for further information. */
+#include "stdafx.h"
+
+#include "bff.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#define ftruncate64(fd, size) _chsize_s(fd, size)
+#define fileno _fileno
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#define ftruncate64(fd, size) ftruncate(fd, size)
+#endif
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+
+
+custom_io::custom_io() : _pb(nullptr), _written(0)
+{
+}
+
+custom_io::~custom_io()
+{
+	if (_pb) {
+		av_freep(&_pb->buffer);
+		av_freep(&_pb);
+	}
+}
+
+void custom_io::open(int buffer_size, bool writable, bool seekable)
+{
+	unsigned char * buffer = (unsigned char *)av_malloc(buffer_size);
+	if (!buffer) {
+		throw ffmpeg_error(AVERROR(ENOMEM), "av_malloc", "custom_io");
+	}
+	_pb = avio_alloc_context(buffer, buffer_size, writable ? 1 : 0, this, writable ? nullptr : &custom_io::read_packet, writable ? &custom_io::write_packet : nullptr, seekable ? &custom_io::seek_packet : nullptr);
+	if (!_pb) {
+		av_free(buffer);
+		throw ffmpeg_error(AVERROR(ENOMEM), "avio_alloc_context", "custom_io");
+	}
+}
+
+// flushes any buffered output; derived classes call this from their destructors while write() still reaches them
+void custom_io::close()
+{
+	if (_pb) {
+		if (_pb->write_flag) {
+			avio_flush(_pb);
+		}
+		av_freep(&_pb->buffer);
+		av_freep(&_pb);
+	}
+}
+
+int custom_io::read(uint8_t * /*buf*/, int /*buf_size*/)
+{
+	return AVERROR(ENOSYS);
+}
+
+int custom_io::write(const uint8_t * /*buf*/, int /*buf_size*/)
+{
+	return AVERROR(ENOSYS);
+}
+
+int64_t custom_io::seek(int64_t /*offset*/, int /*whence*/)
+{
+	return AVERROR(ENOSYS);
+}
+
+int custom_io::read_packet(void * opaque, uint8_t * buf, int buf_size)
+{
+	int rv = ((custom_io *)opaque)->read(buf, buf_size);
+	return rv == 0 ? AVERROR_EOF : rv;
+}
+
+int custom_io::write_packet(void * opaque, uint8_t * buf, int buf_size)
+{
+	custom_io * io = (custom_io *)opaque;
+	int rv = io->write(buf, buf_size);
+	if (rv > 0) {
+		io->_written += rv;
+	}
+	return rv;
+}
+
+int64_t custom_io::seek_packet(void * opaque, int64_t offset, int whence)
+{
+	return ((custom_io *)opaque)->seek(offset, whence & ~AVSEEK_FORCE);
+}
+
+
+output_file::output_file(const std::string & fname, const output_hints & hints, int buffer_size) : _file(nullptr), _discarding(false), _base(0), _hints(hints), _started(0), _dropped(0), _direct_fd(-1), _staging_size(0), _staged(0), _staged_pos(0)
+{
+	_file = fopen(fname.c_str(), "w+b");
+	if (!_file) {
+		throw ffmpeg_error(AVERROR(errno), "fopen", fname.c_str());
+	}
+	// the AVIOContext buffer is the only buffer between the muxer and the OS
+	setvbuf(_file, nullptr, _IONBF, 0);
+	try {
+		apply_hints(fname, buffer_size);
+		open(buffer_size, true, true);
+	} catch (...) {
+		fclose(_file);
+		throw;
+	}
+}
+
+// keeps the first resume_size bytes of an existing file; what is written next is discarded (e.g. a repeated header)
+// until append() says where the output continuing the file begins
+output_file::output_file(const std::string & fname, int64_t resume_size, const output_hints & hints, int buffer_size) : _file(nullptr), _discarding(true), _base(0), _hints(hints), _started(resume_size), _dropped(resume_size), _direct_fd(-1), _staging_size(0), _staged(0), _staged_pos(0)
+{
+	_file = fopen(fname.c_str(), "r+b");
+	if (!_file) {
+		throw ffmpeg_error(AVERROR(errno), "fopen", fname.c_str());
+	}
+	setvbuf(_file, nullptr, _IONBF, 0);
+	try {
+		if ((ftruncate64(fileno(_file), resume_size) != 0) || (fseek64(_file, resume_size, SEEK_SET) != 0)) {
+			throw ffmpeg_error(AVERROR(errno), "ftruncate", fname.c_str());
+		}
+		_hints.preallocate = std::max<int64_t>(_hints.preallocate - resume_size, 0);
+		apply_hints(fname, buffer_size);
+		open(buffer_size, true, true);
+	} catch (...) {
+		fclose(_file);
+		throw;
+	}
+}
+
+// reserves the space asked for and opens the O_DIRECT descriptor; hints the system cannot take are dropped
+void output_file::apply_hints(const std::string & fname, int buffer_size)
+{
+#ifdef __linux__
+	int fd = fileno(_file);
+	// the file's size is left alone, so that the muxer sees only what it has written
+	if ((_hints.preallocate > 0) && (fallocate(fd, FALLOC_FL_KEEP_SIZE, ftell64(_file), _hints.preallocate) != 0)) {
+		_hints.preallocate = 0;
+	}
+	if (_hints.direct) {
+		_direct_fd = ::open(fname.c_str(), O_WRONLY | O_DIRECT);
+		void * p = nullptr;
+		_staging_size = ((size_t)buffer_size + direct_alignment - 1) / direct_alignment * direct_alignment;
+		if ((_direct_fd >= 0) && (posix_memalign(&p, direct_alignment, _staging_size) == 0)) {
+			_staging = std::unique_ptr<uint8_t, std::function<void(uint8_t*)>>((uint8_t *)p, [](uint8_t * p) {
+				free(p);
+			});
+		} else if (_direct_fd >= 0) {
+			::close(_direct_fd);
+			_direct_fd = -1;
+		}
+	}
+#else
+	_hints = output_hints();
+#endif
+}
+
+// output from logical position pos onwards follows the kept part of the file
+void output_file::append(int64_t pos)
+{
+	_discarding = false;
+	_base = ftell64(_file) - pos;
+}
+
+// the number of bytes in the file, as written so far
+int64_t output_file::size() const
+{
+	return ftell64(_file);
+}
+
+// writes out everything written so far, including any staged for O_DIRECT
+void output_file::flush()
+{
+	avio_flush(context());
+	int rv = flush_staged();
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "pwrite", "output");
+	}
+}
+
+// completes the file: flushes it, gives back the preallocated space it did not use and, with drop_cache, waits for
+// it to be written back and drops what is left of it from the page cache
+void output_file::finish()
+{
+	flush();
+#ifdef __linux__
+	int fd = fileno(_file);
+	if ((_hints.preallocate > 0) && ((fseek64(_file, 0, SEEK_END) != 0) || (ftruncate64(fd, ftell64(_file)) != 0))) {
+		throw ffmpeg_error(AVERROR(errno), "ftruncate", "output");
+	}
+	_hints.preallocate = 0;
+	if (_hints.drop_cache) {
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+#endif
+}
+
+output_file::~output_file()
+{
+	close();
+	flush_staged();
+#ifdef __linux__
+	if (_hints.preallocate > 0) {
+		fseek64(_file, 0, SEEK_END);
+		ftruncate64(fileno(_file), ftell64(_file));
+	}
+	if (_direct_fd >= 0) {
+		::close(_direct_fd);
+	}
+#endif
+	fclose(_file);
+}
+
+// writes all of buf at the FILE position; a short write that gives no reason is still an error
+static int write_file(FILE * file, const uint8_t * buf, size_t size)
+{
+	errno = 0;
+	if (fwrite(buf, 1, size, file) != size) {
+		return errno ? AVERROR(errno) : AVERROR(EIO);
+	}
+	return 0;
+}
+
+#ifdef __linux__
+// writes all of buf at pos, going on after partial writes
+static int write_at(int fd, const uint8_t * buf, size_t size, int64_t pos)
+{
+	while (size) {
+		errno = 0;
+		ssize_t n = pwrite(fd, buf, size, pos);
+		if ((n < 0) && (errno == EINTR)) {
+			continue;
+		}
+		if (n <= 0) {
+			return errno ? AVERROR(errno) : AVERROR(EIO);
+		}
+		buf += n;
+		size -= n;
+		pos += n;
+	}
+	return 0;
+}
+#endif
+
+int output_file::write(const uint8_t * buf, int buf_size)
+{
+	if (_discarding) {
+		return buf_size;
+	}
+	if (_direct_fd >= 0) {
+		return write_direct(buf, buf_size);
+	}
+	int rv = write_file(_file, buf, buf_size);
+	if (rv < 0) {
+		return rv;
+	}
+	if (_hints.drop_cache) {
+		release_written();
+	}
+	return buf_size;
+}
+
+// O_DIRECT takes only whole aligned blocks: appended output is staged in the aligned buffer and written from there
+// once it fills, while the output up to the first block boundary, any left over when the muxer seeks, and whatever
+// it rewrites elsewhere goes through the ordinary descriptor. the FILE position is kept where the data is due
+int output_file::write_direct(const uint8_t * buf, int buf_size)
+{
+#ifdef __linux__
+	int64_t pos = ftell64(_file);
+	size_t left = buf_size;
+	int rv = 0;
+	if (_staged && (pos != _staged_pos + (int64_t)_staged)) {
+		rv = flush_staged();
+		if (rv < 0) {
+			return rv;
+		}
+	}
+	if (!_staged && (pos % direct_alignment)) {
+		size_t lead = std::min<size_t>(left, direct_alignment - (size_t)(pos % direct_alignment));
+		rv = write_file(_file, buf, lead);
+		if (rv < 0) {
+			return rv;
+		}
+		buf += lead;
+		left -= lead;
+		pos += lead;
+	}
+	while (left && (_direct_fd >= 0)) {
+		if (!_staged) {
+			_staged_pos = pos;
+		}
+		size_t n = std::min(left, _staging_size - _staged);
+		memcpy(_staging.get() + _staged, buf, n);
+		_staged += n;
+		buf += n;
+		left -= n;
+		pos += n;
+		if (fseek64(_file, (int64_t)n, SEEK_CUR) != 0) {
+			return AVERROR(errno);
+		}
+		if (_staged == _staging_size) {
+			rv = flush_staged();
+			if (rv < 0) {
+				return rv;
+			}
+		}
+	}
+	// O_DIRECT was turned down part way through
+	if (left) {
+		rv = write_file(_file, buf, left);
+		if (rv < 0) {
+			return rv;
+		}
+	}
+#endif
+	return buf_size;
+}
+
+// writes the staged output: its whole blocks with O_DIRECT and the rest through the ordinary descriptor. a file
+// system that turns O_DIRECT down (EINVAL) gets it all through the ordinary descriptor, as it does all output after
+int output_file::flush_staged()
+{
+#ifdef __linux__
+	if (!_staged) {
+		return 0;
+	}
+	size_t whole = _staged / direct_alignment * direct_alignment;
+	int rv = write_at(_direct_fd, _staging.get(), whole, _staged_pos);
+	if (rv == AVERROR(EINVAL)) {
+		::close(_direct_fd);
+		_direct_fd = -1;
+		whole = 0;
+		rv = 0;
+	}
+	if (rv >= 0) {
+		rv = write_at(fileno(_file), _staging.get() + whole, _staged - whole, _staged_pos + whole);
+	}
+	if (rv < 0) {
+		return rv;
+	}
+	_staged = 0;
+#endif
+	return 0;
+}
+
+// starts writeback of each chunk of the output once it is complete, and drops the chunk before it from the page
+// cache; that chunk began writing back a chunk ago, so waiting for it rarely holds up the writer thread
+void output_file::release_written()
+{
+#ifdef __linux__
+	const int64_t chunk = 8 * 1024 * 1024;
+	int64_t pos = ftell64(_file);
+	if (pos - _started < chunk) {
+		return;
+	}
+	int fd = fileno(_file);
+	if (_started > _dropped) {
+		sync_file_range(fd, _dropped, _started - _dropped, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(fd, _dropped, _started - _dropped, POSIX_FADV_DONTNEED);
+		_dropped = _started;
+	}
+	sync_file_range(fd, _started, pos - _started, SYNC_FILE_RANGE_WRITE);
+	_started = pos;
+#endif
+}
+
+int64_t output_file::seek(int64_t offset, int whence)
+{
+	if (_discarding) {
+		return AVERROR(ESPIPE);
+	}
+	// the file's size and contents must include what is staged
+	int rv = flush_staged();
+	if (rv < 0) {
+		return rv;
+	}
+	if (whence == AVSEEK_SIZE) {
+		int64_t pos = ftell64(_file);
+		if ((pos < 0) || (fseek64(_file, 0, SEEK_END) != 0)) {
+			return AVERROR(errno);
+		}
+		int64_t size = ftell64(_file);
+		fseek64(_file, pos, SEEK_SET);
+		return size - _base;
+	}
+	if (fseek64(_file, whence == SEEK_SET ? offset + _base : offset, whence) != 0) {
+		return AVERROR(errno);
+	}
+	return ftell64(_file) - _base;
+}
+
+
+callback_io::callback_io(bff_reader & reader, int buffer_size) : _reader(&reader), _writer(nullptr)
+{
+	if (!reader.read) {
+		throw ffmpeg_error(AVERROR(EINVAL), "callback_io", "read");
+	}
+	open(buffer_size, false, (bool)reader.seek);
+}
+
+callback_io::callback_io(bff_writer & writer, int buffer_size) : _reader(nullptr), _writer(&writer)
+{
+	if (!writer.write) {
+		throw ffmpeg_error(AVERROR(EINVAL), "callback_io", "write");
+	}
+	open(buffer_size, true, (bool)writer.seek);
+}
+
+callback_io::~callback_io()
+{
+	close();
+}
+
+int callback_io::read(uint8_t * buf, int buf_size)
+{
+	return _reader->read(buf, buf_size);
+}
+
+int callback_io::write(const uint8_t * buf, int buf_size)
+{
+	return _writer->write(buf, buf_size);
+}
+
+int64_t callback_io::seek(int64_t offset, int whence)
+{
+	return _reader ? _reader->seek(offset, whence) : _writer->seek(offset, whence);
+}
+
+
+// resolves a seek request against a stream of the given size; returns the new position or a negative AVERROR code
+static int64_t memory_seek(int64_t & pos, int64_t size, int64_t offset, int whence)
+{
+	int64_t next;
+	switch (whence) {
+	case bff_seek_size:
+		return size;
+	case SEEK_SET:
+		next = offset;
+		break;
+	case SEEK_CUR:
+		next = pos + offset;
+		break;
+	case SEEK_END:
+		next = size + offset;
+		break;
+	default:
+		return AVERROR(EINVAL);
+	}
+	if (next < 0) {
+		return AVERROR(EINVAL);
+	}
+	pos = next;
+	return pos;
+}
+
+bff_reader bff_memory_reader(const uint8_t * data, size_t size)
+{
+	std::shared_ptr<int64_t> pos = std::make_shared<int64_t>(0);
+	bff_reader reader;
+	reader.read = [data, size, pos](uint8_t * buf, int buf_size) {
+		if (*pos >= (int64_t)size) {
+			return 0;
+		}
+		int n = (int)std::min<int64_t>(buf_size, (int64_t)size - *pos);
+		memcpy(buf, data + *pos, n);
+		*pos += n;
+		return n;
+	};
+	reader.seek = [size, pos](int64_t offset, int whence) {
+		return memory_seek(*pos, (int64_t)size, offset, whence);
+	};
+	return reader;
+}
+
+bff_writer bff_memory_writer(std::vector<uint8_t> & buffer)
+{
+	std::shared_ptr<int64_t> pos = std::make_shared<int64_t>(0);
+	std::vector<uint8_t> * out = &buffer;
+	out->clear();
+	bff_writer writer;
+	writer.write = [out, pos](const uint8_t * buf, int buf_size) {
+		size_t end = (size_t)*pos + buf_size;
+		if (end > out->size()) {
+			out->resize(end);
+		}
+		memcpy(out->data() + *pos, buf, buf_size);
+		*pos += buf_size;
+		return buf_size;
+	};
+	writer.seek = [out, pos](int64_t offset, int whence) {
+		return memory_seek(*pos, (int64_t)out->size(), offset, whence);
+	};
+	return writer;
+}
+
+int write_file_atomically(const std::string & fname, const std::string & bytes)
+{
+	std::string temp = fname + ".tmp";
+	FILE * f = fopen(temp.c_str(), "wb");
+	if (!f) {
+		return AVERROR(errno);
+	}
+	int rv = 0;
+	if ((fwrite(bytes.data(), 1, bytes.size(), f) != bytes.size()) || (fflush(f) != 0)) {
+		rv = AVERROR(EIO);
+#ifdef _WIN32
+	} else if (_commit(fileno(f)) != 0) {
+#else
+	} else if (fsync(fileno(f)) != 0) {
+#endif
+		rv = AVERROR(errno);
+	}
+	if ((fclose(f) != 0) && (rv == 0)) {
+		rv = AVERROR(EIO);
+	}
+	if (rv == 0) {
+#ifdef _WIN32
+		remove(fname.c_str());
+#endif
+		if (rename(temp.c_str(), fname.c_str()) != 0) {
+			rv = AVERROR(errno);
+		}
+	}
+	if (rv < 0) {
+		remove(temp.c_str());
+	}
+	return rv;
+}
@@ -0,0 +1,290 @@
+/*	bff - Black Frame Filter for FFmpeg
+	Copyright (C) 2017 Michael Trenholm-Boyle.
+	This software is redistributable under a permissive open source license.
+	See the LICENSE file for further information. */
+#ifndef LIBBFF_H_INCLUDED
+#define LIBBFF_H_INCLUDED
+
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+class ffmpeg_error : public std::runtime_error
+{
+private:
+	int _er;
+	std::string _fn;
+	std::string _arg;
+	static std::string format_message(int er, const char * fn, const char * arg);
+public:
+	explicit ffmpeg_error(int av_error_code, const char * function_name, const char * function_args) : std::runtime_error(format_message(av_error_code, function_name, function_args)), _er(av_error_code), _fn(function_name), _arg(function_args)
+	{}
+	ffmpeg_error(const ffmpeg_error &e) : std::runtime_error(e), _er(e._er), _fn(e._fn), _arg(e._arg)
+	{}
+	~ffmpeg_error()
+	{}
+	int error_code() const
+	{
+		return _er;
+	}
+	const char * function_name() const
+	{
+		return _fn.c_str();
+	}
+	const char * function_args() const
+	{
+		return _arg.c_str();
+	}
+};
+
+
+// a rectangle of a video frame in pixels; a width or height of 0 extends to the edge of the frame
+struct bff_rect
+{
+	int x = 0;
+	int y = 0;
+	int width = 0;
+	int height = 0;
+};
+
+// how a frame is judged black
+enum class bff_detection
+{
+	// at least proportion_threshold of the luma samples are at or below y_max
+	proportional,
+	// the luma mean and standard deviation are at or below mean_threshold and stdev_threshold
+	statistical
+};
+
+// parameters of the black frame detectors
+struct bff_detector_options
+{
+	bff_detection detection = bff_detection::proportional;
+	// only this part of each frame is examined (by default, all of it) ...
+	bff_rect region;
+	// ... or, if auto_region is set, the area left once always-black letterbox or pillarbox bars are excluded
+	bool auto_region = false;
+	// the bars are found from the first auto_region_frames frames with any picture content
+	int auto_region_frames = 50;
+	// parts of the region never examined, e.g. a burnt-in timecode or a logo
+	std::vector<bff_rect> exclusions;
+	// luma values at or below y_max count as black
+	int y_max = 17;
+	// a frame is black when at least this proportion of its examined pixels are black
+	double proportion_threshold = 0.86;
+	// statistical detector: a frame is black when its luma mean and standard deviation are both at or below these
+	double mean_threshold = 17;
+	double stdev_threshold = 1;
+	// proportional detector sampling: examine every sample_step-th row and column (1 = every pixel) ...
+	int sample_step = 1;
+	// ... widened as needed to take at most sample_budget samples per frame (0 = no limit), making the cost independent of resolution
+	int sample_budget = 0;
+	// a sampled proportion within this many standard errors of proportion_threshold is confirmed by a full scan
+	double sample_error_z = 4;
+	// threads used to scan a large frame in horizontal stripes (0 = one per hardware thread, 1 = scan on the decoding thread)
+	int detect_threads = 0;
+	// frames with fewer luma samples than this to examine are scanned on one thread
+	int64_t parallel_min_samples = 2000000;
+	// skip the pixel scan of frames whose compressed packet is far larger than a black frame of the same picture type.
+	// off by default because it has not been validated: only prefilter_verify measures the black frames it misses
+	bool packet_prefilter = false;
+	// frames of a picture type are always scanned until this many have been seen
+	int prefilter_warmup = 25;
+	// a packet "could be black" up to prefilter_factor times the largest black packet seen of its picture type;
+	// any packet could be black until a black frame of that type has been scanned
+	double prefilter_factor = 2;
+	// scan prefiltered frames anyway and count those that were black (for validating the prefilter)
+	bool prefilter_verify = false;
+	// give a frame the verdict of the frame before it, without scanning, when a hash of a sparse grid of the luma
+	// samples the detectors would examine is the same, as it is for held shots, title cards and frozen frames
+	bool fingerprint = false;
+	// the grid has this many rows and columns
+	int fingerprint_grid = 64;
+	// scan fingerprinted frames anyway and count those whose verdict differed (for validating the fingerprint)
+	bool fingerprint_verify = false;
+};
+
+// an inclusive range of zero-based video frame numbers
+struct bff_frame_range
+{
+	uint64_t first;
+	uint64_t last;
+};
+
+// the frames one detector configuration of a sweep judged black
+struct bff_sweep_result
+{
+	bff_detector_options detector;
+	uint64_t black_frame_count = 0;
+	std::vector<bff_frame_range> black_ranges;
+};
+
+// what is done with black frames
+enum class bff_mode
+{
+	// replace each black frame with the most recent non-black frame
+	substitute,
+	// drop black frames and the matching span of audio, shortening the output
+	cut,
+	// encode nothing for black frames so that the previous frame is displayed for longer (variable frame rate)
+	hold
+};
+
+// an additional output encoded from the same filtered video at another size and quality, e.g. a rung of an ABR ladder
+struct bff_rendition
+{
+	std::string output;
+	// the picture size; a width or height of 0 keeps the aspect ratio of the other, and both 0 keep the input's size
+	int width = 0;
+	int height = 0;
+	// the average video bit rate in bits per second, capped at the same rate over a two second buffer;
+	// 0 encodes at constant quality instead, like the main output
+	int64_t bit_rate = 0;
+};
+
+struct bff_options
+{
+	bff_detector_options detector;
+	bff_mode mode = bff_mode::substitute;
+	// the progress callback is invoked every this many decoded video frames (0 = never)
+	uint64_t progress_interval = 100;
+	// only the part of the input from start up to end seconds is filtered (0 = from the beginning, or to the end);
+	// reading begins at the keyframe before start and stops after end
+	double start = 0;
+	double end = 0;
+	// save a checkpoint at the first keyframe after every this many seconds of video (0 = never);
+	// the output is then a fragmented MP4 whose complete fragments survive a crash (not available in cut mode)
+	double checkpoint_interval = 0;
+	// where the checkpoint is kept (by default, the output file name followed by .checkpoint)
+	std::string checkpoint_file;
+	// keep the detector's verdicts in a file beside the input, and reuse them when the same input is filtered again
+	// with the same detector settings, skipping the detection kernels ...
+	bool detection_cache = false;
+	// ... unless this is set, in which case every frame is detected again and the cache rewritten
+	bool refresh_detection_cache = false;
+	// how much of the input is read to find the parameters of its streams before filtering starts: at most probe_size
+	// bytes and analyze_duration seconds (0 = FFmpeg's defaults, 5 MB and 5 seconds)
+	int64_t probe_size = 0;
+	double analyze_duration = 0;
+	// demux the input on its own thread, up to read_ahead_bytes (and read_ahead_packets packets) ahead of decoding, so
+	// that slow storage stalls the pipeline only once all that has been used up (0 = read on the decoding thread)
+	int64_t read_ahead_bytes = 0;
+	int read_ahead_packets = 8192;
+	// keep the stream parameters found in an input file beside it, and use them instead of probing when the same input
+	// is opened again
+	bool probe_cache = false;
+	// continue from the checkpoint of an interrupted run of the same input, if there is one, instead of starting over
+	bool resume = false;
+	// the bytes of frames and packets the pipeline may buffer (0 = no limit); x264's lookahead and the muxer's queue are
+	// shortened to fit, and processing fails if even the smallest buffering of the input's frame size does not
+	int64_t memory_budget = 0;
+	// rewrite this file every metrics_interval seconds with the progress of the run in the Prometheus text format,
+	// e.g. for the node exporter's textfile collector (by default, no file is written)
+	std::string metrics_file;
+	double metrics_interval = 10;
+	// for bulk runs on shared hosts (Linux only): drop the output from the page cache as it is written back, so that a
+	// long run does not evict the pages of other work ...
+	bool output_drop_cache = false;
+	// ... or bypass the page cache altogether with O_DIRECT
+	bool output_direct_io = false;
+	// reserve as much disk space for the output as the input file takes up, so that it is not extended piecemeal;
+	// whatever is not used is released at the end (Linux only)
+	bool output_preallocate = false;
+	// further outputs written alongside the main one, each scaled and encoded on its own thread from the frames the
+	// main output is encoded from, with a copy of its audio (not available with checkpoints)
+	std::vector<bff_rendition> renditions;
+};
+
+struct bff_stats
+{
+	uint64_t video_frame_count = 0;
+	uint64_t audio_frame_count = 0;
+	uint64_t black_frame_count = 0;
+	uint64_t video_packet_count = 0;
+	uint64_t audio_packet_count = 0;
+	// frames judged non-black by the packet size prefilter without scanning their pixels
+	uint64_t scans_avoided = 0;
+	// with prefilter_verify, prefiltered frames that a scan found to be black
+	uint64_t prefilter_misses = 0;
+	// frames given the verdict of the frame before them by their matching fingerprint and, with fingerprint_verify,
+	// those of them whose scan disagreed
+	uint64_t fingerprint_hits = 0;
+	uint64_t fingerprint_misses = 0;
+	// in cut mode, the number of audio samples removed along with black frames
+	uint64_t audio_samples_cut = 0;
+	// verdicts taken from the detection cache instead of the detectors
+	uint64_t cached_verdicts = 0;
+	// the most bytes held at once in frames and queued packets, and the peak resident set size of the process
+	int64_t peak_tracked_bytes = 0;
+	int64_t peak_rss_bytes = 0;
+	// with read-ahead, the seconds decoding waited for the input with nothing read ahead
+	double read_wait_seconds = 0;
+};
+
+typedef std::function<void(const bff_stats & stats)> bff_progress_callback;
+// invoked for every deinterlaced video frame with its zero-based index, its presentation timestamp and the detector verdict
+typedef std::function<void(uint64_t frame_number, int64_t pts, bool black)> bff_verdict_callback;
+
+
+// the whence value asking a seek callback for the total stream size (FFmpeg's AVSEEK_SIZE)
+static const int bff_seek_size = 0x10000;
+
+// a source of input bytes used in place of an input file
+struct bff_reader
+{
+	// fills buf with up to size bytes; returns the number read, 0 at end of stream, or a negative AVERROR code
+	std::function<int(uint8_t * buf, int size)> read;
+	// optional; whence is SEEK_SET, SEEK_CUR, SEEK_END or bff_seek_size; returns the new position (or the size) or a negative AVERROR code
+	std::function<int64_t(int64_t offset, int whence)> seek;
+};
+
+// a sink for output bytes used in place of an output file
+struct bff_writer
+{
+	// consumes size bytes; returns size, or a negative AVERROR code
+	std::function<int(const uint8_t * buf, int size)> write;
+	// optional, as for bff_reader; without it the MP4 output is written fragmented
+	std::function<int64_t(int64_t offset, int whence)> seek;
+};
+
+// reads from a caller-owned buffer that must outlive the processing
+extern bff_reader bff_memory_reader(const uint8_t * data, size_t size);
+// writes into (and grows) a caller-owned vector that must outlive the processing
+extern bff_writer bff_memory_writer(std::vector<uint8_t> & buffer);
+
+
+// a configured black frame filter; process() may be called any number of times, one input at a time
+class bff_pipeline
+{
+private:
+	bff_options _options;
+	bff_progress_callback _progress;
+	bff_verdict_callback _verdict;
+public:
+	explicit bff_pipeline(const bff_options & options = bff_options());
+	const bff_options & options() const
+	{
+		return _options;
+	}
+	void on_progress(bff_progress_callback callback)
+	{
+		_progress = callback;
+	}
+	void on_verdict(bff_verdict_callback callback)
+	{
+		_verdict = callback;
+	}
+	// filters the input file into an MP4 output file, replacing it if it exists (unless resuming); throws ffmpeg_error on failure
+	bff_stats process(const std::string & input, const std::string & output);
+	// as above, but reads and writes through callbacks so that media never touches the file system
+	bff_stats process(bff_reader & input, bff_writer & output);
+	// decodes the input once and reports the black frames found by each detector configuration, writing no output;
+	// the detection and thresholds come from each configuration, the region and scanning options from this pipeline's
+	std::vector<bff_sweep_result> sweep(const std::string & input, const std::vector<bff_detector_options> & configs);
+};
+
+
+#endif
@@ -0,0 +1,137 @@
+/*	bff - Black Frame Filter for FFmpeg
+	Copyright (C) 2017 Michael Trenholm-Boyle.
+	This software is redistributable under a permissive open source license.
+	See the LICENSE file for further information. */
+#include "stdafx.h"
+
+#include "bff.h"
+
+#include <ctime>
+#include <sstream>
+
+
+static const char * const stage_names[stage_count] = { "read", "decode", "deinterlace", "detect", "encode", "mux" };
+
+// escapes a label value for the Prometheus text format
+static std::string label_value(const std::string & s)
+{
+	std::string escaped;
+	for (char c : s) {
+		if (c == '\\') {
+			escaped += "\\\\";
+		} else if (c == '"') {
+			escaped += "\\\"";
+		} else if (c == '\n') {
+			escaped += "\\n";
+		} else {
+			escaped += c;
+		}
+	}
+	return escaped;
+}
+
+metrics_writer::metrics_writer(const std::string & fname, const std::string & input, double interval) : _file(fname), _input(label_value(input)), _interval(std::max(interval, 0.1)), _stopping(false), _last_frames(0), _last_time(std::chrono::steady_clock::now()), _progress_time((int64_t)time(nullptr)), _next_update(_last_time)
+{
+	_thread = std::thread(&metrics_writer::run, this);
+}
+
+// writes the last snapshot as that of a run no longer in progress, whether it completed or failed
+metrics_writer::~metrics_writer()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stopping = true;
+		_wake.notify_all();
+	}
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	write(_metrics, 0, false);
+}
+
+// true when it is time to take a new snapshot: four times per interval, so that the one written is never more than
+// a quarter of an interval old, while the pipeline spends nothing on the frames in between
+bool metrics_writer::due()
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (now < _next_update) {
+		return false;
+	}
+	_next_update = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(_interval / 4));
+	return true;
+}
+
+// replaces the snapshot written next
+void metrics_writer::update(const job_metrics & metrics)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_metrics = metrics;
+}
+
+void metrics_writer::run()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (!_wake.wait_for(lock, std::chrono::duration<double>(_interval), [this]() {
+		return _stopping;
+	})) {
+		job_metrics metrics = _metrics;
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		double elapsed = std::chrono::duration<double>(now - _last_time).count();
+		double fps = elapsed > 0 ? (metrics.stats.video_frame_count - _last_frames) / elapsed : 0;
+		if (metrics.stats.video_frame_count != _last_frames) {
+			_progress_time = (int64_t)time(nullptr);
+		}
+		_last_frames = metrics.stats.video_frame_count;
+		_last_time = now;
+		// the file is written without holding the lock so that the pipeline never waits on the disk
+		lock.unlock();
+		write(metrics, fps, true);
+		lock.lock();
+	}
+}
+
+// writes to a temporary file and renames it over the last one, so that a scrape never sees a partial file;
+// a file that cannot be written is skipped rather than failing the run
+void metrics_writer::write(const job_metrics & metrics, double fps, bool running)
+{
+	std::string label = "{input=\"" + _input + "\"}";
+	std::ostringstream out;
+	auto metric = [&](const char * name, const char * type, const char * help) {
+		out << "# HELP bff_" << name << " " << help << "\n";
+		out << "# TYPE bff_" << name << " " << type << "\n";
+	};
+	metric("running", "gauge", "Whether the run is still in progress.");
+	out << "bff_running" << label << " " << (running ? 1 : 0) << "\n";
+	metric("video_frames_total", "counter", "Video frames decoded.");
+	out << "bff_video_frames_total" << label << " " << metrics.stats.video_frame_count << "\n";
+	metric("black_frames_total", "counter", "Video frames judged black.");
+	out << "bff_black_frames_total" << label << " " << metrics.stats.black_frame_count << "\n";
+	metric("audio_frames_total", "counter", "Audio frames decoded.");
+	out << "bff_audio_frames_total" << label << " " << metrics.stats.audio_frame_count << "\n";
+	metric("frames_per_second", "gauge", "Video frames decoded per second over the last interval.");
+	out << "bff_frames_per_second" << label << " " << fps << "\n";
+	metric("last_progress_timestamp_seconds", "gauge", "When the number of video frames decoded last increased.");
+	out << "bff_last_progress_timestamp_seconds" << label << " " << _progress_time << "\n";
+	metric("stage_busy_seconds_total", "counter", "Time spent in each stage of the pipeline.");
+	for (int i = 0; i < stage_count; ++i) {
+		out << "bff_stage_busy_seconds_total{input=\"" << _input << "\",stage=\"" << stage_names[i] << "\"} " << metrics.busy[i] << "\n";
+	}
+	metric("queue_packets", "gauge", "Packets waiting for the output writer thread.");
+	out << "bff_queue_packets{input=\"" << _input << "\",queue=\"mux\"} " << metrics.mux_queue_packets << "\n";
+	out << "bff_queue_packets{input=\"" << _input << "\",queue=\"read\"} " << metrics.read_queue_packets << "\n";
+	metric("queue_bytes", "gauge", "Bytes of packets waiting for the output writer thread.");
+	out << "bff_queue_bytes{input=\"" << _input << "\",queue=\"mux\"} " << metrics.mux_queue_bytes << "\n";
+	out << "bff_queue_bytes{input=\"" << _input << "\",queue=\"read\"} " << metrics.read_queue_bytes << "\n";
+	metric("queue_frames", "gauge", "Frames inside the video encoder, and audio frames held back in cut mode.");
+	out << "bff_queue_frames{input=\"" << _input << "\",queue=\"encoder\"} " << metrics.encoder_frames << "\n";
+	out << "bff_queue_frames{input=\"" << _input << "\",queue=\"held_audio\"} " << metrics.held_audio_frames << "\n";
+	metric("read_wait_seconds_total", "counter", "Time decoding waited for the input with nothing read ahead.");
+	out << "bff_read_wait_seconds_total" << label << " " << metrics.stats.read_wait_seconds << "\n";
+	metric("memory_bytes", "gauge", "Bytes held in frames and queued packets.");
+	out << "bff_memory_bytes" << label << " " << metrics.memory_bytes << "\n";
+	metric("read_bytes_total", "counter", "Bytes read from the input.");
+	out << "bff_read_bytes_total" << label << " " << metrics.bytes_read << "\n";
+	metric("written_bytes_total", "counter", "Bytes written to the output.");
+	out << "bff_written_bytes_total" << label << " " << metrics.bytes_written << "\n";
+	write_file_atomically(_file, out.str());
+}
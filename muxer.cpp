@@ -0,0 +1,323 @@
+/*	bff - Black Frame Filter for FFmpeg
+	Copyright (C) 2017 Michael Trenholm-Boyle.
+	This software is redistributable under a permissive open source license.
+	See the LICENSE file for further information. */
+#include "stdafx.h"
+
+#include "bff.h"
+
+
+memory_account::memory_account() : _live(0), _peak(0)
+{
+}
+
+void memory_account::add(int64_t bytes)
+{
+	int64_t live = _live += bytes;
+	int64_t peak = _peak.load();
+	while ((live > peak) && !_peak.compare_exchange_weak(peak, live)) {
+	}
+}
+
+void memory_account::remove(int64_t bytes)
+{
+	_live -= bytes;
+}
+
+int64_t memory_account::live() const
+{
+	return _live.load();
+}
+
+int64_t memory_account::peak() const
+{
+	return _peak.load();
+}
+
+
+packet_queue::packet_queue(size_t max_packets, size_t max_bytes, memory_account * account) : _account(account), _max_packets(max_packets), _max_bytes(max_bytes), _bytes(0), _closed(false)
+{
+}
+
+packet_queue::~packet_queue()
+{
+	clear();
+}
+
+// moves the packet's references into the queue, waiting for room if the queue is full;
+// returns false (leaving the packet untouched) if the queue has been closed
+bool packet_queue::push(AVPacket * packet)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	// an oversized packet is still admitted once the queue has drained
+	_not_full.wait(lock, [this, packet]() {
+		return _closed || _packets.empty() || ((_packets.size() < _max_packets) && (_bytes + packet->size <= _max_bytes));
+	});
+	if (_closed) {
+		return false;
+	}
+	AVPacket * p = av_packet_alloc();
+	if (!p) {
+		throw ffmpeg_error(AVERROR(ENOMEM), "av_packet_alloc", "packet_queue");
+	}
+	av_packet_move_ref(p, packet);
+	_packets.push_back(p);
+	_bytes += p->size;
+	if (_account) {
+		_account->add(p->size);
+	}
+	_not_empty.notify_one();
+	return true;
+}
+
+// moves the oldest queued packet into the caller's packet, waiting for one to arrive and adding the seconds spent
+// waiting to *waited, if given; returns false once the queue is closed and drained
+bool packet_queue::pop(AVPacket * packet, double * waited)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	// only an actual wait is timed
+	std::unique_ptr<stage_timer> timer;
+	if (waited && !_closed && _packets.empty()) {
+		timer.reset(new stage_timer(*waited));
+	}
+	_not_empty.wait(lock, [this]() {
+		return _closed || !_packets.empty();
+	});
+	timer.reset();
+	if (_packets.empty()) {
+		return false;
+	}
+	AVPacket * p = _packets.front();
+	_packets.pop_front();
+	_bytes -= p->size;
+	if (_account) {
+		_account->remove(p->size);
+	}
+	av_packet_move_ref(packet, p);
+	av_packet_free(&p);
+	_not_full.notify_one();
+	return true;
+}
+
+void packet_queue::close()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_closed = true;
+	_not_empty.notify_all();
+	_not_full.notify_all();
+}
+
+// the number and size of the packets queued
+void packet_queue::depth(size_t & packets, size_t & bytes)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	packets = _packets.size();
+	bytes = _bytes;
+}
+
+void packet_queue::clear()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	for (AVPacket * p : _packets) {
+		av_packet_free(&p);
+	}
+	_packets.clear();
+	if (_account) {
+		_account->remove(_bytes);
+	}
+	_bytes = 0;
+	_not_full.notify_all();
+}
+
+
+muxer::muxer(AVFormatContext * format, size_t max_packets, size_t max_bytes, memory_account * account) : _format(format), _account(account), _queue(max_packets, max_bytes, account), _pending(format->nb_streams), _pending_count(0), _pending_bytes(0), _max_pending(max_packets), _max_pending_bytes(max_bytes), _queued(0), _written(0), _busy(0)
+{
+	_thread = std::thread(&muxer::run, this);
+}
+
+muxer::~muxer()
+{
+	_queue.close();
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	for (std::deque<AVPacket *> & pending : _pending) {
+		for (AVPacket * p : pending) {
+			av_packet_free(&p);
+		}
+	}
+}
+
+void muxer::run()
+{
+	try {
+		std::unique_ptr<AVPacket, std::function<void(AVPacket *)>> packet(av_packet_alloc(), [](AVPacket *p) {
+			av_packet_free(&p);
+		});
+		if (!packet) {
+			throw ffmpeg_error(AVERROR(ENOMEM), "av_packet_alloc", "muxer");
+		}
+		while (_queue.pop(packet.get())) {
+			if (packet->stream_index < 0) {
+				// flush() is waiting for everything before this marker
+				while (write_next(true)) {
+				}
+			} else {
+				interleave(packet.get());
+				while (write_next(false)) {
+				}
+			}
+		}
+		while (write_next(true)) {
+		}
+	} catch (...) {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_error = std::current_exception();
+			_idle.notify_all();
+		}
+		// unblock the producer; anything still queued can never be written
+		_queue.close();
+		_queue.clear();
+	}
+}
+
+// moves a packet from the queue to its stream's pending packets
+void muxer::interleave(AVPacket * packet)
+{
+	AVPacket * p = av_packet_alloc();
+	if (!p) {
+		throw ffmpeg_error(AVERROR(ENOMEM), "av_packet_alloc", "muxer");
+	}
+	av_packet_move_ref(p, packet);
+	_pending[p->stream_index].push_back(p);
+	++_pending_count;
+	_pending_bytes += p->size;
+	if (_account) {
+		_account->add(p->size);
+	}
+}
+
+// writes the pending packet with the earliest decoding time once every stream has one pending, so that a stream
+// never runs ahead of another that is still being produced (or, given all, whatever is pending); too many pending
+// packets are written anyway, e.g. when a stream has ended early; returns false if nothing was written
+bool muxer::write_next(bool all)
+{
+	std::deque<AVPacket *> * next = nullptr;
+	for (std::deque<AVPacket *> & pending : _pending) {
+		if (pending.empty()) {
+			if (!all && (_pending_count <= _max_pending) && (_pending_bytes <= _max_pending_bytes)) {
+				return false;
+			}
+		} else if (!next || (av_compare_ts(pending.front()->dts, _format->streams[pending.front()->stream_index]->time_base, next->front()->dts, _format->streams[next->front()->stream_index]->time_base) < 0)) {
+			next = &pending;
+		}
+	}
+	if (!next) {
+		return false;
+	}
+	AVPacket * p = next->front();
+	next->pop_front();
+	--_pending_count;
+	_pending_bytes -= p->size;
+	if (_account) {
+		_account->remove(p->size);
+	}
+	std::unique_ptr<AVPacket, std::function<void(AVPacket *)>> packet(p, [](AVPacket *p) {
+		av_packet_free(&p);
+	});
+	double busy = 0;
+	stage_timer timer(busy);
+	int rv = av_interleaved_write_frame(_format, packet.get());
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "av_interleaved_write_frame", _format->streams[packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO ? "audio" : "video");
+	}
+	timer.stop();
+	std::lock_guard<std::mutex> lock(_mutex);
+	_busy += busy;
+	++_written;
+	_idle.notify_all();
+	return true;
+}
+
+void muxer::rethrow()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_error) {
+		std::rethrow_exception(_error);
+	}
+}
+
+// hands the packet to the writer thread; blocks while the queue is full
+void muxer::write(AVPacket * packet)
+{
+	if (!_queue.push(packet)) {
+		rethrow();
+		throw ffmpeg_error(AVERROR_EXIT, "muxer::write", "closed");
+	}
+	std::lock_guard<std::mutex> lock(_mutex);
+	++_queued;
+}
+
+// waits until every packet handed over so far has been passed to the format context;
+// the writer thread is then idle, so the context may be used until the next write()
+void muxer::flush()
+{
+	// a marker after the packets makes the writer thread write those it is holding back
+	std::unique_ptr<AVPacket, std::function<void(AVPacket *)>> marker(av_packet_alloc(), [](AVPacket *p) {
+		av_packet_free(&p);
+	});
+	if (!marker) {
+		throw ffmpeg_error(AVERROR(ENOMEM), "av_packet_alloc", "muxer");
+	}
+	marker->stream_index = -1;
+	if (!_queue.push(marker.get())) {
+		rethrow();
+	}
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_idle.wait(lock, [this]() {
+			return _error || (_written == _queued);
+		});
+	}
+	rethrow();
+}
+
+// drains the queue and stops the writer thread; the trailer may be written afterwards
+void muxer::finish()
+{
+	_queue.close();
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	rethrow();
+}
+
+// the seconds the writer thread has spent writing packets
+double muxer::busy()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _busy;
+}
+
+void muxer::depth(size_t & packets, size_t & bytes)
+{
+	_queue.depth(packets, bytes);
+}
+
+void rescale_packet(AVPacket * packet, AVRational from, AVRational to, int64_t & pts, int64_t & dts)
+{
+	av_packet_rescale_ts(packet, from, to);
+	if (packet->pts <= pts) {
+		++pts;
+		packet->pts = pts;
+	} else {
+		pts = packet->pts;
+	}
+	if (packet->dts <= dts) {
+		++dts;
+		packet->dts = dts;
+	} else {
+		dts = packet->dts;
+	}
+}
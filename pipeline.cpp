@@ -0,0 +1,1756 @@
+/*	bff - Black Frame Filter for FFmpeg
+	Copyright (C) 2017 Michael Trenholm-Boyle.
+	This software is redistributable under a permissive open source license.
+	See the LICENSE file for further information. */
+#include "stdafx.h"
+
+#include "bff.h"
+
+extern "C" {
+#include <libavutil/opt.h>
+#include <libavutil/avstring.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/audio_fifo.h>
+#include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
+#include <libavfilter/buffersrc.h>
+#include <libavfilter/buffersink.h>
+}
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+std::string ffmpeg_error::format_message(int er, const char * fn, const char * arg)
+{
+	char em[100] = { 0 }, bm[200] = { 0 };
+	av_strerror(er, em, sizeof(em) - 1);
+	snprintf(bm, sizeof(bm) - 1, "%s(%s) failed; return = %d: %s", fn, arg, er, em);
+	return bm;
+}
+
+
+static avframe_ptr alloc_frame(const char * what)
+{
+	avframe_ptr frame(av_frame_alloc(), [](AVFrame * p) {
+		av_frame_free(&p);
+	});
+	if (!frame) {
+		throw ffmpeg_error(AVERROR(ENOMEM), "av_frame_alloc", what);
+	}
+	return frame;
+}
+
+static avpacket_ptr alloc_packet(const char * what)
+{
+	avpacket_ptr packet(av_packet_alloc(), [](AVPacket *p) {
+		av_packet_free(&p);
+	});
+	if (!packet) {
+		throw ffmpeg_error(AVERROR(ENOMEM), "av_packet_alloc", what);
+	}
+	return packet;
+}
+
+// the bytes of the buffers a frame references
+static int64_t frame_bytes(const AVFrame * frame)
+{
+	int64_t bytes = 0;
+	for (int i = 0; i < AV_NUM_DATA_POINTERS; ++i) {
+		if (frame->buf[i]) {
+			bytes += frame->buf[i]->size;
+		}
+	}
+	for (int i = 0; i < frame->nb_extended_buf; ++i) {
+		bytes += frame->extended_buf[i]->size;
+	}
+	return bytes;
+}
+
+// the largest resident set size of the process so far, or 0 if it is unknown
+static int64_t peak_rss()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc = {};
+	pmc.cb = sizeof(pmc);
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+		return (int64_t)pmc.PeakWorkingSetSize;
+	}
+	return 0;
+#else
+	struct rusage usage = {};
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+#ifdef __APPLE__
+	return (int64_t)usage.ru_maxrss;
+#else
+	return (int64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+
+// state of a single input-to-output run of the pipeline
+class bff_job
+{
+private:
+	const bff_options & _opts;
+	const bff_progress_callback & _progress;
+	const bff_verdict_callback & _verdict;
+	bff_stats _stats;
+	// custom I/O, if any, must outlive the format contexts using it
+	std::unique_ptr<custom_io> _input_io;
+	std::unique_ptr<custom_io> _output_io;
+	// input
+	avformat_ptr _informat;
+	int _video_stream_index;
+	int _audio_stream_index;
+	bool _has_audio;
+	avcodec_ptr _invcodec;
+	avcodec_ptr _inacodec;
+	// output
+	avformat_ptr _oformat;
+	AVStream * _ovstream;
+	AVStream * _oastream;
+	avcodec_ptr _ovcodec;
+	avcodec_ptr _oacodec;
+	bool _sws_required;
+	bool _swr_required;
+	// deinterlacing
+	avfiltergraph_ptr _filter_graph;
+	AVFilterContext * _bufferctx;
+	AVFilterContext * _buffersinkctx;
+	// black frame substitution
+	// the detector options in effect, with the region found by auto_region once it has settled
+	bff_detector_options _detector;
+	letterbox_detector _letterbox;
+	packet_size_prefilter _prefilter;
+	// scans large frames in stripes (the calling thread's pool, kept warm between jobs); null when detection is single-threaded
+	worker_pool * _workers;
+	avframe_ptr _prev_frame;
+	bool _have_prev_frame;
+	// the fingerprint of the last frame judged by a scan (or by its fingerprint), and that verdict
+	uint64_t _fingerprint;
+	bool _have_fingerprint;
+	bool _fingerprint_black;
+	uint64_t _frame_number;
+	int64_t _apts, _adts, _vpts, _vdts;
+	// hold mode: the timestamp of the last black frame not encoded, if the run has not ended
+	int64_t _held_pts;
+	// cut mode: spans of input video time removed so far, and audio held back until the video over it is decided
+	struct cut_span
+	{
+		int64_t start;
+		int64_t end;
+	};
+	std::deque<cut_span> _cuts;
+	int64_t _video_cut;
+	int64_t _video_decided;
+	int64_t _audio_removed;
+	std::deque<avframe_ptr> _pending_audio;
+	// sweep: one result per configuration, and the histogram they share
+	std::vector<bff_sweep_result> * _sweep;
+	luma_histogram _histogram;
+	// the requested range of input, in AV_TIME_BASE units (AV_NOPTS_VALUE = from the beginning or to the end)
+	int64_t _start;
+	int64_t _end;
+	// checkpointing: where the state is saved, the run being continued (if any) and the file it is written to
+	std::string _input_name;
+	std::string _checkpoint_file;
+	const checkpoint_state * _resume;
+	output_file * _output_file;
+	int64_t _checkpoint_dts;
+	int _fragments;
+	int64_t _aend;
+	// set while input already in the output is decoded again to rebuild the substitution state
+	bool _replaying;
+	// the counters as they stood before each video frame not yet written was decoded
+	struct frame_snapshot
+	{
+		int64_t pts;
+		bff_stats stats;
+		uint64_t frame_number;
+	};
+	std::deque<frame_snapshot> _snapshots;
+	// verdicts of earlier runs, if enabled
+	std::unique_ptr<verdict_cache> _cache;
+	// the bytes held in frames and queued packets, and the sizes of the frames inside the video encoder
+	memory_account _memory;
+	std::deque<int64_t> _encoding;
+	// monitoring: the seconds spent in each stage on this thread, and the file they are reported in, if any
+	double _busy[stage_count];
+	std::unique_ptr<metrics_writer> _metrics;
+	// with read-ahead, the input is demuxed on its own thread into this queue, and the bytes read counted there
+	std::unique_ptr<packet_queue> _read_packets;
+	std::thread _read_thread;
+	std::exception_ptr _read_error;
+	std::atomic<int64_t> _read_bytes;
+	// packets read while checking cached stream parameters, decoded before anything else is read
+	std::deque<avpacket_ptr> _probed_packets;
+	// audio is decoded and encoded on its own thread, fed through this queue, unless its frames wait on video decisions
+	// (cut mode) or checkpoints need both streams stopped at the same point
+	std::unique_ptr<packet_queue> _audio_packets;
+	std::thread _audio_thread;
+	std::exception_ptr _audio_error;
+	// audio counters and busy times, kept by whichever thread runs the audio and published to the others under the mutex
+	struct audio_progress
+	{
+		uint64_t frames = 0;
+		uint64_t packets = 0;
+		double busy[stage_count] = {};
+	};
+	audio_progress _audio;
+	audio_progress _audio_published;
+	std::mutex _audio_mutex;
+	// samples are regrouped here into frames of the size the audio encoder takes, starting from a frame with
+	// timestamp _fifo_pts of which _fifo_samples have been encoded
+	std::unique_ptr<AVAudioFifo, std::function<void(AVAudioFifo*)>> _audio_fifo;
+	avframe_ptr _fifo_frame;
+	int64_t _fifo_pts;
+	int64_t _fifo_samples;
+	// further outputs encoded from the same frames
+	std::vector<std::unique_ptr<rendition>> _renditions;
+	// the encoder lookahead (-1 = the preset's) and muxer queue size that fit the memory budget
+	int _lookahead;
+	size_t _queue_bytes;
+	// declared last so that the writer thread is stopped before the output is torn down
+	std::unique_ptr<muxer> _mux;
+
+	void open_format(const std::string & fname, AVIOContext * pb);
+	void open_input(const std::string & fname, AVIOContext * pb);
+	bool verify_stream_info();
+	void open_output(const std::string & fname, AVIOContext * pb);
+	size_t fit_memory_budget(AVDictionary ** vopts);
+	void open_deinterlacer();
+	void seek_to_start();
+	bool before_start(int64_t ts, AVRational time_base) const;
+	bool after_end(int64_t ts, AVRational time_base) const;
+	void read_input();
+	void start_reading();
+	void run_reading();
+	void stop_reading();
+	int read_packet(AVPacket * packet);
+	void resume();
+	void checkpoint(int64_t video_pts, int64_t video_dts);
+	void decode_video(AVPacket * packet);
+	void filter_video(AVFrame * frame);
+	void update_region(AVFrame * frame);
+	bool detect_black_frame(AVFrame * frame);
+	bool scan_black_frame(AVFrame * frame);
+	void sweep_video(AVFrame * frame);
+	void substitute_black_frame(AVFrame * frame, bool black);
+	void remember_frame(AVFrame * frame);
+	void cut_black_frame(AVFrame * frame, bool black);
+	void hold_black_frame(AVFrame * frame, bool black);
+	int64_t video_frame_duration(const AVFrame * frame) const;
+	void release_audio(bool all);
+	void cut_audio_frame(AVFrame * frame);
+	void encode_video(AVFrame * frame);
+	void start_audio();
+	void run_audio();
+	void finish_audio();
+	void process_audio(AVPacket * packet);
+	void publish_audio();
+	void collect_audio_stats();
+	void decode_audio(AVPacket * packet);
+	void encode_audio(AVFrame * frame);
+	void send_audio(AVFrame * frame);
+	void write_packet(AVPacket * packet, AVCodecContext * codec, AVStream * stream, int64_t & pts, int64_t & dts);
+	void publish_metrics();
+public:
+	bff_job(const bff_options & opts, const bff_progress_callback & progress, const bff_verdict_callback & verdict);
+	~bff_job();
+	void run(const std::string & input, custom_io * input_io, const std::string & output, custom_io * output_io);
+	void sweep(const std::string & input, custom_io * input_io, std::vector<bff_sweep_result> & results);
+	void checkpoint_to(const std::string & fname, const checkpoint_state * resume);
+	void cache_verdicts(verdict_cache * cache);
+	const bff_stats & stats() const
+	{
+		return _stats;
+	}
+};
+
+
+bff_job::bff_job(const bff_options & opts, const bff_progress_callback & progress, const bff_verdict_callback & verdict) : _opts(opts), _progress(progress), _verdict(verdict), _video_stream_index(-1), _audio_stream_index(-1), _has_audio(false), _ovstream(nullptr), _oastream(nullptr), _sws_required(false), _swr_required(false), _bufferctx(nullptr), _buffersinkctx(nullptr), _detector(opts.detector), _letterbox(opts.detector), _prefilter(opts.detector), _workers(nullptr), _have_prev_frame(false), _fingerprint(0), _have_fingerprint(false), _fingerprint_black(false), _frame_number(0), _apts(LLONG_MIN), _adts(LLONG_MIN), _vpts(LLONG_MIN), _vdts(LLONG_MIN), _held_pts(AV_NOPTS_VALUE), _video_cut(0), _video_decided(LLONG_MIN), _audio_removed(0), _sweep(nullptr), _start(AV_NOPTS_VALUE), _end(AV_NOPTS_VALUE), _resume(nullptr), _output_file(nullptr), _checkpoint_dts(AV_NOPTS_VALUE), _fragments(0), _aend(AV_NOPTS_VALUE), _replaying(false), _busy(), _read_bytes(0), _fifo_pts(0), _fifo_samples(0), _lookahead(-1), _queue_bytes(muxer::default_max_bytes)
+{
+	int threads = worker_pool::default_threads(opts.detector.detect_threads);
+	if (threads > 1) {
+		_workers = worker_pool::for_this_thread(threads);
+	}
+}
+
+bff_job::~bff_job()
+{
+	stop_reading();
+	// after a failure the audio thread may still be running, and must stop before what it uses is torn down
+	if (_audio_packets) {
+		_audio_packets->close();
+		_audio_packets->clear();
+	}
+	if (_audio_thread.joinable()) {
+		_audio_thread.join();
+	}
+}
+
+// converts a frame into a new frame of another size and pixel format, keeping its properties
+static avframe_ptr scale_frame(const AVFrame * frame, int width, int height, AVPixelFormat format)
+{
+	int rv;
+	avframe_ptr scaled(av_frame_alloc(), [](AVFrame * p) {
+		av_freep(p->data);
+		av_frame_free(&p);
+	});
+	if (!scaled) {
+		throw ffmpeg_error(AVERROR(ENOMEM), "av_frame_alloc", "sws");
+	}
+	std::unique_ptr<SwsContext, std::function<void(SwsContext*)>> sws(sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format, width, height, format, SWS_FAST_BILINEAR, nullptr, nullptr, nullptr), [](SwsContext *p) {
+		if (p) {
+			sws_freeContext(p);
+		}
+	});
+	if (!sws) {
+		throw ffmpeg_error(AVERROR(EINVAL), "sws_getContext", "sws");
+	}
+	scaled->format = format;
+	scaled->width = width;
+	scaled->height = height;
+	rv = av_image_alloc(scaled->data, scaled->linesize, width, height, format, 32);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "av_image_alloc", "sws");
+	}
+	rv = sws_scale(sws.get(), frame->data, frame->linesize, 0, frame->height, scaled->data, scaled->linesize);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "sws_scale", "");
+	}
+	rv = av_frame_copy_props(scaled.get(), frame);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "av_frame_copy_props", "sws");
+	}
+	return scaled;
+}
+
+// filters input to output; an input_io or output_io, when given, is owned by the job and used in place of the named file
+void bff_job::run(const std::string & input, custom_io * input_io, const std::string & output, custom_io * output_io)
+{
+	int rv;
+	_input_io.reset(input_io);
+	_output_io.reset(output_io);
+	_input_name = input;
+	_output_file = dynamic_cast<output_file *>(_output_io.get());
+	if (!_opts.metrics_file.empty()) {
+		_metrics.reset(new metrics_writer(_opts.metrics_file, input, _opts.metrics_interval));
+	}
+	if (!_checkpoint_file.empty() && !_output_file) {
+		throw ffmpeg_error(AVERROR(EINVAL), "checkpoint", "output must be a file");
+	}
+	if (!_checkpoint_file.empty() && !_opts.renditions.empty()) {
+		// a checkpoint records the state of one output file
+		throw ffmpeg_error(AVERROR(ENOSYS), "checkpoint", "renditions");
+	}
+	open_input(input, _input_io ? _input_io->context() : nullptr);
+	open_output(output, _output_io->context());
+	// the renditions' sizes are unknown, so they are not preallocated
+	output_hints hints;
+	hints.drop_cache = _opts.output_drop_cache;
+	hints.direct = _opts.output_direct_io;
+	for (const bff_rendition & spec : _opts.renditions) {
+		_renditions.emplace_back(new rendition(spec, _ovcodec.get(), _has_audio ? _oacodec.get() : nullptr, _oastream, _lookahead, _queue_bytes, &_memory, hints));
+	}
+	open_deinterlacer();
+	if (_resume) {
+		resume();
+	} else {
+		seek_to_start();
+	}
+	_prev_frame = alloc_frame("prev_frame");
+	if (_has_audio && (_opts.mode != bff_mode::cut) && _checkpoint_file.empty()) {
+		start_audio();
+	}
+	read_input();
+	finish_audio();
+	// flush
+	if ((_opts.mode == bff_mode::cut) && _has_audio) {
+		release_audio(true);
+	}
+	if (_held_pts != AV_NOPTS_VALUE) {
+		// a trailing black run needs one more frame to end the held frame at the right time
+		_prev_frame->pts = _held_pts;
+		_prev_frame->pict_type = AV_PICTURE_TYPE_NONE;
+		encode_video(_prev_frame.get());
+	}
+	if (_ovcodec->codec->capabilities & AV_CODEC_CAP_DELAY) {
+		encode_video(nullptr);
+	}
+	if (_has_audio && !_audio_packets) {
+		encode_audio(nullptr);
+	}
+	publish_audio();
+	collect_audio_stats();
+	for (std::unique_ptr<rendition> & r : _renditions) {
+		r->finish();
+	}
+	_mux->finish();
+	rv = av_write_trailer(_oformat.get());
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "av_write_trailer", "");
+	}
+	if (_output_file) {
+		_output_file->finish();
+	}
+	if (_cache) {
+		_cache->save();
+	}
+	_stats.peak_tracked_bytes = _memory.peak();
+	_stats.peak_rss_bytes = peak_rss();
+	publish_metrics();
+}
+
+// saves a checkpoint to fname at intervals and, given resume, continues the run that saved it
+void bff_job::checkpoint_to(const std::string & fname, const checkpoint_state * resume)
+{
+	_checkpoint_file = fname;
+	_resume = resume;
+}
+
+// restores the counters and watermarks of the checkpoint and seeks the input back to where it was taken;
+// input decoded again up to the checkpoint only rebuilds state
+void bff_job::resume()
+{
+	_stats = _resume->stats;
+	_audio.frames = _stats.audio_frame_count;
+	_audio.packets = _stats.audio_packet_count;
+	publish_audio();
+	_frame_number = _resume->frame_number;
+	_fragments = _resume->fragments;
+	_vpts = _resume->vpts;
+	_vdts = _resume->vdts;
+	_apts = _resume->apts;
+	_adts = _resume->adts;
+	int64_t target = av_rescale_q(_resume->video_pts, _ovcodec->time_base, AV_TIME_BASE_Q);
+	if (_has_audio && (_resume->audio_end != LLONG_MIN)) {
+		target = std::min(target, av_rescale_q(_resume->audio_end, _oacodec->time_base, AV_TIME_BASE_Q));
+	}
+	int rv = avformat_seek_file(_informat.get(), -1, INT64_MIN, target, target, 0);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avformat_seek_file", "checkpoint");
+	}
+	_probed_packets.clear();
+}
+
+// makes everything before the keyframe with these timestamps durable and records how to continue from it
+void bff_job::checkpoint(int64_t video_pts, int64_t video_dts)
+{
+	_mux->flush();
+	// the writer thread is idle: drain the interleaving queue and close the current fragment
+	int rv = av_interleaved_write_frame(_oformat.get(), nullptr);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "av_interleaved_write_frame", "checkpoint");
+	}
+	rv = av_write_frame(_oformat.get(), nullptr);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "av_write_frame", "checkpoint");
+	}
+	_output_file->flush();
+	checkpoint_state state;
+	state.input = _input_name;
+	state.output_size = _output_file->size();
+	state.fragments = _fragments;
+	state.video_pts = video_pts;
+	state.audio_end = (_has_audio && (_aend != AV_NOPTS_VALUE)) ? av_rescale_q(_aend, _oastream->time_base, _oacodec->time_base) : LLONG_MIN;
+	state.vpts = _vpts;
+	state.vdts = _vdts;
+	state.apts = _apts;
+	state.adts = _adts;
+	if (!_snapshots.empty() && (_snapshots.front().pts == video_pts)) {
+		state.stats = _snapshots.front().stats;
+		state.frame_number = _snapshots.front().frame_number;
+	} else {
+		state.stats = _stats;
+		state.frame_number = _frame_number;
+	}
+	state.save(_checkpoint_file);
+	_checkpoint_dts = video_dts;
+}
+
+// takes verdicts from the cache where it has them, and records all of them for saving at the end of the run
+void bff_job::cache_verdicts(verdict_cache * cache)
+{
+	_cache.reset(cache);
+}
+
+// decodes the input's video and fills in the results, one per detector configuration
+void bff_job::sweep(const std::string & input, custom_io * input_io, std::vector<bff_sweep_result> & results)
+{
+	_input_io.reset(input_io);
+	_sweep = &results;
+	if (!_opts.metrics_file.empty()) {
+		_metrics.reset(new metrics_writer(_opts.metrics_file, input, _opts.metrics_interval));
+	}
+	open_input(input, _input_io ? _input_io->context() : nullptr);
+	seek_to_start();
+	read_input();
+	publish_metrics();
+}
+
+// seeks to the keyframe at or before the start of the requested range; the frames before the start are decoded and discarded
+void bff_job::seek_to_start()
+{
+	if (_start == AV_NOPTS_VALUE) {
+		return;
+	}
+	int rv = av_seek_frame(_informat.get(), -1, _start, AVSEEK_FLAG_BACKWARD);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "av_seek_frame", "start");
+	}
+	_probed_packets.clear();
+}
+
+// true if a timestamp lies before the start of the requested range
+bool bff_job::before_start(int64_t ts, AVRational time_base) const
+{
+	return (_start != AV_NOPTS_VALUE) && (ts != AV_NOPTS_VALUE) && (av_compare_ts(ts, time_base, _start, AV_TIME_BASE_Q) < 0);
+}
+
+// true if a timestamp lies at or after the end of the requested range
+bool bff_job::after_end(int64_t ts, AVRational time_base) const
+{
+	return (_end != AV_NOPTS_VALUE) && (ts != AV_NOPTS_VALUE) && (av_compare_ts(ts, time_base, _end, AV_TIME_BASE_Q) >= 0);
+}
+
+// demuxes and decodes the input up to its end or the end of the requested range
+void bff_job::read_input()
+{
+	bool audio = _has_audio && !_sweep;
+	bool video_ended = false, audio_ended = !audio;
+	if (_opts.read_ahead_bytes > 0) {
+		start_reading();
+	}
+	while (true) {
+		avpacket_ptr inpacket = alloc_packet("input");
+		stage_timer timer(_busy[stage_read]);
+		int rv = read_packet(inpacket.get());
+		timer.stop();
+		if (rv == AVERROR_EOF) {
+			break;
+		} else if (rv < 0) {
+			throw ffmpeg_error(rv, "av_read_frame", "input");
+		}
+		bool is_video = inpacket->stream_index == _video_stream_index;
+		bool is_audio = audio && (inpacket->stream_index == _audio_stream_index);
+		if ((is_video || is_audio) && after_end(inpacket->dts, _informat->streams[inpacket->stream_index]->time_base)) {
+			// decode order is presentation order from here on, so nothing later in this stream is wanted
+			video_ended = video_ended || is_video;
+			audio_ended = audio_ended || is_audio;
+			if (video_ended && audio_ended) {
+				// drain the decoders of the frames still inside the range, and stop reading
+				decode_video(nullptr);
+				if (audio) {
+					process_audio(nullptr);
+				}
+				break;
+			}
+		} else if (is_video && !video_ended) {
+			decode_video(inpacket.get());
+		} else if (is_audio && !audio_ended) {
+			process_audio(inpacket.get());
+		}
+	}
+	stop_reading();
+}
+
+void bff_job::start_reading()
+{
+	_read_packets.reset(new packet_queue(std::max(_opts.read_ahead_packets, 1), (size_t)_opts.read_ahead_bytes, &_memory));
+	_read_thread = std::thread(&bff_job::run_reading, this);
+}
+
+// the read-ahead thread: demuxes until the end of the input, an error, or the queue is closed by stop_reading()
+void bff_job::run_reading()
+{
+	try {
+		avpacket_ptr packet = alloc_packet("read ahead");
+		while (true) {
+			int rv = av_read_frame(_informat.get(), packet.get());
+			if (rv == AVERROR_EOF) {
+				break;
+			} else if (rv < 0) {
+				throw ffmpeg_error(rv, "av_read_frame", "input");
+			}
+			_read_bytes = _informat->pb ? _informat->pb->bytes_read : 0;
+			if (!_read_packets->push(packet.get())) {
+				return;
+			}
+		}
+	} catch (...) {
+		_read_error = std::current_exception();
+	}
+	// the packets already queued are still decoded
+	_read_packets->close();
+}
+
+// stops the read-ahead thread, if there is one, discarding whatever it read that was not wanted
+void bff_job::stop_reading()
+{
+	if (!_read_packets) {
+		return;
+	}
+	_read_packets->close();
+	_read_packets->clear();
+	if (_read_thread.joinable()) {
+		_read_thread.join();
+	}
+}
+
+// the next packet of the input, as av_read_frame() returns it, from the read-ahead queue if reading ahead
+int bff_job::read_packet(AVPacket * packet)
+{
+	if (!_probed_packets.empty()) {
+		av_packet_move_ref(packet, _probed_packets.front().get());
+		_probed_packets.pop_front();
+		return 0;
+	}
+	if (!_read_packets) {
+		return av_read_frame(_informat.get(), packet);
+	}
+	if (_read_packets->pop(packet, &_stats.read_wait_seconds)) {
+		return 0;
+	}
+	// the read-ahead thread has stopped at the end of the input, or failed
+	if (_read_thread.joinable()) {
+		_read_thread.join();
+	}
+	if (_read_error) {
+		std::rethrow_exception(_read_error);
+	}
+	return AVERROR_EOF;
+}
+
+// opens the input's container and reads its header
+void bff_job::open_format(const std::string & fname, AVIOContext * pb)
+{
+	int rv;
+	AVFormatContext *p = nullptr;
+	if (pb) {
+		p = avformat_alloc_context();
+		if (!p) {
+			throw ffmpeg_error(AVERROR(ENOMEM), "avformat_alloc_context", "input");
+		}
+		p->pb = pb;
+		p->flags |= AVFMT_FLAG_CUSTOM_IO;
+	}
+	AVDictionary * iopts = nullptr;
+	if (_opts.probe_size > 0) {
+		av_dict_set_int(&iopts, "probesize", _opts.probe_size, 0);
+	}
+	if (_opts.analyze_duration > 0) {
+		av_dict_set_int(&iopts, "analyzeduration", (int64_t)(_opts.analyze_duration * AV_TIME_BASE), 0);
+	}
+	// avformat_open_input frees a preallocated context on failure
+	rv = avformat_open_input(&p, fname.c_str(), nullptr, &iopts);
+	av_dict_free(&iopts);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avformat_open_input", fname.c_str());
+	}
+	_informat = avformat_ptr(p, [](AVFormatContext *p) {
+		avformat_close_input(&p);
+	});
+}
+
+void bff_job::open_input(const std::string & fname, AVIOContext * pb)
+{
+	int rv;
+	open_format(fname, pb);
+	// probing reads up to probe_size bytes of the input before the first frame is filtered; a file seen before needn't be
+	std::unique_ptr<stream_info_cache> cache;
+	if (_opts.probe_cache && !pb) {
+		cache.reset(new stream_info_cache(fname));
+	}
+	bool cached = cache && cache->apply(_informat.get());
+	if (cached && !verify_stream_info()) {
+		// the cache's key missed a change to the input, e.g. one rewritten in place at the same size; probe it afresh
+		cache->drop();
+		_probed_packets.clear();
+		_informat.reset();
+		open_format(fname, pb);
+		cached = false;
+	}
+	if (!cached) {
+		rv = avformat_find_stream_info(_informat.get(), nullptr);
+		if (rv < 0) {
+			throw ffmpeg_error(rv, "avformat_find_stream_info", "");
+		}
+		if (cache) {
+			cache->save(_informat.get());
+		}
+	}
+	// the requested range is measured from the start of the input
+	int64_t origin = (_informat->start_time == AV_NOPTS_VALUE) ? 0 : _informat->start_time;
+	if (_opts.start > 0) {
+		_start = origin + (int64_t)(_opts.start * AV_TIME_BASE);
+	}
+	if (_opts.end > 0) {
+		_end = origin + (int64_t)(_opts.end * AV_TIME_BASE);
+	}
+	AVCodec *q = nullptr;
+	rv = av_find_best_stream(_informat.get(), AVMEDIA_TYPE_VIDEO, -1, -1, &q, 0);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "av_find_best_stream", "AVMEDIA_TYPE_VIDEO");
+	}
+	_video_stream_index = rv;
+	_invcodec = avcodec_ptr(avcodec_alloc_context3(q), [](AVCodecContext *p) {
+		avcodec_free_context(&p);
+	});
+	rv = avcodec_parameters_to_context(_invcodec.get(), _informat->streams[_video_stream_index]->codecpar);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avcodec_parameters_to_context", "video");
+	}
+	rv = av_opt_set_int(_invcodec.get(), "refcounted_frames", 1, 0);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "av_opt_set_int", "refcounted_frames/video");
+	}
+	rv = avcodec_open2(_invcodec.get(), q, nullptr);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avcodec_open2", "video");
+	}
+	q = nullptr;
+	rv = av_find_best_stream(_informat.get(), AVMEDIA_TYPE_AUDIO, -1, -1, &q, 0);
+	_has_audio = rv >= 0;
+	_audio_stream_index = _has_audio ? rv : -1;
+	if (_has_audio) {
+		_inacodec = avcodec_ptr(avcodec_alloc_context3(q), [](AVCodecContext *p) {
+			avcodec_free_context(&p);
+		});
+		rv = avcodec_parameters_to_context(_inacodec.get(), _informat->streams[_audio_stream_index]->codecpar);
+		if (rv < 0) {
+			throw ffmpeg_error(rv, "avcodec_parameters_to_context", "audio");
+		}
+		rv = avcodec_open2(_inacodec.get(), q, nullptr);
+		if (rv < 0) {
+			throw ffmpeg_error(rv, "avcodec_open2", "audio");
+		}
+	}
+}
+
+// decodes the input up to its first video frame with a decoder of its own, and checks that the cached parameters
+// describe it: the codec must decode it at the cached size and pixel format, and any extradata sent in band must
+// be the cached extradata. the packets read are kept for the pipeline to decode
+bool bff_job::verify_stream_info()
+{
+	AVCodec * q = nullptr;
+	int index = av_find_best_stream(_informat.get(), AVMEDIA_TYPE_VIDEO, -1, -1, &q, 0);
+	if (index < 0) {
+		return false;
+	}
+	const AVCodecParameters * par = _informat->streams[index]->codecpar;
+	avcodec_ptr decoder(avcodec_alloc_context3(q), [](AVCodecContext *p) {
+		avcodec_free_context(&p);
+	});
+	if (!decoder || (avcodec_parameters_to_context(decoder.get(), par) < 0) || (avcodec_open2(decoder.get(), q, nullptr) < 0)) {
+		return false;
+	}
+	avframe_ptr frame = alloc_frame("stream info check");
+	// enough for the decoder's delay with B-frames
+	const int max_packets = 64;
+	for (int n = 0; n < max_packets; ) {
+		avpacket_ptr read = alloc_packet("stream info check");
+		if (av_read_frame(_informat.get(), read.get()) < 0) {
+			return false;
+		}
+		AVPacket * packet = read.get();
+		_probed_packets.push_back(std::move(read));
+		if (packet->stream_index != index) {
+			continue;
+		}
+		++n;
+		int size = 0;
+		const uint8_t * extradata = av_packet_get_side_data(packet, AV_PKT_DATA_NEW_EXTRADATA, &size);
+		if (extradata && ((size != par->extradata_size) || (memcmp(extradata, par->extradata, size) != 0))) {
+			return false;
+		}
+		if (avcodec_send_packet(decoder.get(), packet) < 0) {
+			return false;
+		}
+		int rv = avcodec_receive_frame(decoder.get(), frame.get());
+		if (rv == 0) {
+			return (decoder->codec_id == par->codec_id) && (frame->width == par->width) && (frame->height == par->height) && (frame->format == par->format);
+		} else if (rv != AVERROR(EAGAIN)) {
+			return false;
+		}
+	}
+	return false;
+}
+
+void bff_job::open_output(const std::string & fname, AVIOContext * pb)
+{
+	int rv;
+	_oformat = avformat_ptr(avformat_alloc_context(), [](AVFormatContext *p) {
+		avformat_free_context(p);
+	});
+	_oformat->pb = pb;
+	_oformat->flags |= AVFMT_FLAG_CUSTOM_IO;
+	_oformat->oformat = av_guess_format("mp4", nullptr, nullptr);
+	av_strlcpy(_oformat->filename, fname.c_str(), sizeof(_oformat->filename));
+	AVStream * invstream = _informat->streams[_video_stream_index];
+	AVCodec * h264 = avcodec_find_encoder(AV_CODEC_ID_H264);
+	_ovstream = avformat_new_stream(_oformat.get(), h264);
+	_ovcodec = avcodec_ptr(avcodec_alloc_context3(h264), [](AVCodecContext *p) {
+		avcodec_free_context(&p);
+	});
+	_ovcodec->pix_fmt = AV_PIX_FMT_YUV420P;
+	_ovcodec->width = _invcodec->width;
+	_ovcodec->height = _invcodec->height;
+	_ovcodec->framerate = invstream->avg_frame_rate;
+	_ovcodec->sample_aspect_ratio = _invcodec->sample_aspect_ratio;
+	_ovcodec->time_base = invstream->time_base;
+	std::unique_ptr<AVDictionary*, std::function<void(AVDictionary**)>> vopts((AVDictionary **)calloc(1, sizeof(AVDictionary*)), [](AVDictionary **p) {
+		if (*p) {
+			av_dict_free(p);
+		}
+		if (p) {
+			free(p);
+		}
+	});
+	av_dict_set(vopts.get(), "profile", "Main", 0);
+	av_dict_set(vopts.get(), "level", "4.1", 0);
+	av_dict_set(vopts.get(), "preset", "slow", 0);
+	av_dict_set(vopts.get(), "crf", "18", 0);
+	_queue_bytes = fit_memory_budget(vopts.get());
+	rv = avcodec_open2(_ovcodec.get(), h264, vopts.get());
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avcodec_open2", "h264");
+	}
+	rv = avcodec_parameters_from_context(_ovstream->codecpar, _ovcodec.get());
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avcodec_parameters_from_context", "video");
+	}
+	if (_oformat->oformat->flags & AVFMT_GLOBALHEADER) {
+		_ovcodec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	}
+	_ovstream->time_base = _ovcodec->time_base;
+	if (_has_audio) {
+		AVCodec * aac = avcodec_find_encoder(AV_CODEC_ID_AAC);
+		_oastream = avformat_new_stream(_oformat.get(), aac);
+		_oacodec = avcodec_ptr(avcodec_alloc_context3(aac), [](AVCodecContext *p) {
+			avcodec_free_context(&p);
+		});
+		_oacodec->sample_rate = 48000;
+		_oacodec->channel_layout = AV_CH_LAYOUT_STEREO;
+		_oacodec->channels = 2;
+		_oacodec->sample_fmt = AV_SAMPLE_FMT_FLTP;
+		_oacodec->time_base = _inacodec->time_base;
+		rv = avcodec_open2(_oacodec.get(), aac, nullptr);
+		if (rv < 0) {
+			throw ffmpeg_error(rv, "avcodec_open2", "aac");
+		}
+		if ((_oacodec->frame_size > 0) && !(_oacodec->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)) {
+			_audio_fifo = std::unique_ptr<AVAudioFifo, std::function<void(AVAudioFifo*)>>(av_audio_fifo_alloc(_oacodec->sample_fmt, _oacodec->channels, 2 * _oacodec->frame_size), [](AVAudioFifo *p) {
+				av_audio_fifo_free(p);
+			});
+			if (!_audio_fifo) {
+				throw ffmpeg_error(AVERROR(ENOMEM), "av_audio_fifo_alloc", "aac");
+			}
+			_fifo_frame = alloc_frame("aac");
+			_fifo_frame->format = _oacodec->sample_fmt;
+			_fifo_frame->channels = _oacodec->channels;
+			_fifo_frame->channel_layout = _oacodec->channel_layout;
+			_fifo_frame->sample_rate = _oacodec->sample_rate;
+			_fifo_frame->nb_samples = _oacodec->frame_size;
+			rv = av_frame_get_buffer(_fifo_frame.get(), 0);
+			if (rv < 0) {
+				throw ffmpeg_error(rv, "av_frame_get_buffer", "aac");
+			}
+		}
+		rv = avcodec_parameters_from_context(_oastream->codecpar, _oacodec.get());
+		if (rv < 0) {
+			throw ffmpeg_error(rv, "avcodec_parameters_from_context", "audio");
+		}
+		if (_oformat->oformat->flags & AVFMT_GLOBALHEADER) {
+			_oacodec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+		}
+		_oastream->time_base = _oacodec->time_base;
+	}
+	std::unique_ptr<AVDictionary*, std::function<void(AVDictionary**)>> fopts((AVDictionary **)calloc(1, sizeof(AVDictionary*)), [](AVDictionary **p) {
+		if (*p) {
+			av_dict_free(p);
+		}
+		if (p) {
+			free(p);
+		}
+	});
+	if (!_checkpoint_file.empty()) {
+		// complete fragments survive a crash and a restarted run appends to them, so each fragment is
+		// self-contained and carries absolute timestamps; the trailing index is left out as it could not cover both runs
+		av_dict_set(fopts.get(), "movflags", "frag_keyframe+empty_moov+default_base_moof+frag_discont+skip_trailer", 0);
+		if (_resume) {
+			av_dict_set_int(fopts.get(), "fragment_index", _resume->fragments + 1, 0);
+		}
+	} else if (!pb->seekable) {
+		// the moov atom cannot be patched in afterwards, so write a fragmented MP4
+		av_dict_set(fopts.get(), "movflags", "frag_keyframe+empty_moov", 0);
+	}
+	rv = avformat_write_header(_oformat.get(), fopts.get());
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avformat_write_header", "");
+	}
+	if (_resume) {
+		// the output already starts with this header; what follows it continues the kept fragments
+		avio_flush(pb);
+		_output_file->append(avio_tell(pb));
+	}
+	// packets are handed to a writer thread so output latency does not stall the encoders
+	_mux.reset(new muxer(_oformat.get(), muxer::default_max_packets, _queue_bytes, &_memory));
+	_sws_required = (_invcodec->pix_fmt != _ovcodec->pix_fmt) || (_invcodec->width != _ovcodec->width) || (_invcodec->height != _ovcodec->height);
+	_swr_required = _has_audio && ((_inacodec->sample_fmt != _oacodec->sample_fmt) || (_inacodec->sample_rate != _oacodec->sample_rate) || (_inacodec->channels != _oacodec->channels) || (_inacodec->channel_layout != _oacodec->channel_layout));
+}
+
+// shortens x264's lookahead, which holds the most frames, so that the frames and packets buffered fit the memory budget;
+// returns the bytes the muxer may queue
+size_t bff_job::fit_memory_budget(AVDictionary ** vopts)
+{
+	if (_opts.memory_budget <= 0) {
+		return muxer::default_max_bytes;
+	}
+	int64_t budget = _opts.memory_budget;
+	size_t queue_bytes = (size_t)std::max<int64_t>(1024 * 1024, std::min<int64_t>(budget / 8, muxer::default_max_bytes));
+	int64_t input_frame = av_image_get_buffer_size(_invcodec->pix_fmt, _invcodec->width, _invcodec->height, 1);
+	int64_t output_frame = av_image_get_buffer_size(_ovcodec->pix_fmt, _ovcodec->width, _ovcodec->height, 1);
+	if ((input_frame <= 0) || (output_frame <= 0)) {
+		throw ffmpeg_error(AVERROR(EINVAL), "av_image_get_buffer_size", "memory budget");
+	}
+	// x264 keeps each frame with its padding and a half-resolution copy, in every output
+	int64_t encoder_frame = 2 * output_frame;
+	int outputs = 1 + (int)_opts.renditions.size();
+	for (const bff_rendition & spec : _opts.renditions) {
+		int width, height;
+		rendition::frame_size(spec, _ovcodec.get(), width, height);
+		encoder_frame += 2 * av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 1);
+	}
+	// the decoder's reference frames (at most 16 for H.264), the frames in the deinterlacer and the substitute frame,
+	// the frames queued for renditions, x264's reference and B-frames at the slow preset, each muxer's queue and
+	// the packets it holds back to interleave, and the input read ahead
+	int64_t fixed = 16 * input_frame + (4 + (int64_t)rendition::max_frames * (outputs - 1)) * output_frame + 10 * encoder_frame + 2 * outputs * (int64_t)queue_bytes + _opts.read_ahead_bytes;
+	if (budget < fixed) {
+		throw ffmpeg_error(AVERROR(ENOMEM), "memory budget", "too small for the frame size");
+	}
+	_lookahead = (int)std::min<int64_t>((budget - fixed) / encoder_frame, 50);
+	av_dict_set_int(vopts, "rc-lookahead", _lookahead, 0);
+	return queue_bytes;
+}
+
+// configure filter graph for deinterlacing
+void bff_job::open_deinterlacer()
+{
+	int rv;
+	_filter_graph = avfiltergraph_ptr(avfilter_graph_alloc(), [](AVFilterGraph *p) {
+		avfilter_graph_free(&p);
+	});
+	AVFilter * buffer = avfilter_get_by_name("buffer");
+	if (!buffer) {
+		throw ffmpeg_error(AVERROR_UNKNOWN, "avfilter_get_by_name", "buffer");
+	}
+	AVFilter * buffersink = avfilter_get_by_name("buffersink");
+	if (!buffersink) {
+		throw ffmpeg_error(AVERROR_UNKNOWN, "avfilter_get_by_name", "buffersink");
+	}
+	const size_t arglen = 32*32;
+	char * args = (char *)alloca(arglen);
+	memset(args, 0, arglen);
+	AVRational time_base = _ovcodec->time_base;
+	snprintf(args, arglen, "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d", _ovcodec->width, _ovcodec->height, _ovcodec->pix_fmt, time_base.num, time_base.den, _ovcodec->sample_aspect_ratio.num, _ovcodec->sample_aspect_ratio.den);
+	rv = avfilter_graph_create_filter(&_bufferctx, buffer, "in", args, nullptr, _filter_graph.get());
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avfilter_graph_create_filter", args);
+	}
+	rv = avfilter_graph_create_filter(&_buffersinkctx, buffersink, "out", nullptr, nullptr, _filter_graph.get());
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avfilter_graph_create_filter", "out");
+	}
+	AVFilterInOut * inputs = avfilter_inout_alloc(), *outputs = avfilter_inout_alloc();
+	if (!outputs || !inputs) {
+		throw ffmpeg_error(AVERROR_UNKNOWN, "avfilter_inout_alloc", "");
+	}
+	outputs->name = av_strdup("in");
+	outputs->filter_ctx = _bufferctx;
+	outputs->pad_idx = 0;
+	outputs->next = nullptr;
+	inputs->name = av_strdup("out");
+	inputs->filter_ctx = _buffersinkctx;
+	inputs->pad_idx = 0;
+	inputs->next = nullptr;
+	rv = avfilter_graph_parse_ptr(_filter_graph.get(), "kerndeint", &inputs, &outputs, nullptr);
+	avfilter_inout_free(&inputs);
+	avfilter_inout_free(&outputs);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avfilter_graph_parse_ptr", "kerndeint");
+	}
+	rv = avfilter_graph_config(_filter_graph.get(), nullptr);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avfilter_graph_parse_ptr", "");
+	}
+}
+
+void bff_job::decode_video(AVPacket * packet)
+{
+	if (_opts.detector.packet_prefilter) {
+		_prefilter.sent(packet);
+	}
+	stage_timer send_timer(_busy[stage_decode]);
+	int rv = avcodec_send_packet(_invcodec.get(), packet);
+	send_timer.stop();
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avcodec_send_packet", "input");
+	}
+	while (rv >= 0) {
+		avframe_ptr frame = alloc_frame("input video");
+		stage_timer timer(_busy[stage_decode]);
+		rv = avcodec_receive_frame(_invcodec.get(), frame.get());
+		timer.stop();
+		if (rv == AVERROR(EAGAIN) || rv == AVERROR_EOF) {
+			break;
+		} else if (rv < 0) {
+			throw ffmpeg_error(rv, "avcodec_receive_frame", "input video");
+		} else if (before_start(frame->best_effort_timestamp, _informat->streams[_video_stream_index]->time_base) || after_end(frame->best_effort_timestamp, _informat->streams[_video_stream_index]->time_base)) {
+			// outside the requested range
+			continue;
+		} else if (_resume && (frame->best_effort_timestamp < _resume->video_pts)) {
+			// already in the output
+			bff_stats stats = _stats;
+			uint64_t frame_number = _frame_number;
+			_replaying = true;
+			filter_video(frame.get());
+			_replaying = false;
+			_stats = stats;
+			_frame_number = frame_number;
+		} else {
+			if (!_checkpoint_file.empty()) {
+				collect_audio_stats();
+				frame_snapshot snapshot = { frame->best_effort_timestamp, _stats, _frame_number };
+				_snapshots.push_back(snapshot);
+			}
+			++_stats.video_frame_count;
+			if (_metrics && _metrics->due()) {
+				publish_metrics();
+			}
+			if (_progress && _opts.progress_interval && ((_stats.video_frame_count % _opts.progress_interval) == 0)) {
+				collect_audio_stats();
+				_progress(_stats);
+			}
+			if (_sweep) {
+				sweep_video(frame.get());
+			} else {
+				filter_video(frame.get());
+			}
+		}
+	}
+}
+
+void bff_job::filter_video(AVFrame * frame)
+{
+	int rv;
+	avframe_ptr sws_frame;
+	if (_sws_required) {
+		sws_frame = scale_frame(frame, _ovcodec->width, _ovcodec->height, _ovcodec->pix_fmt);
+	}
+	AVFrame * curframe = _sws_required ? sws_frame.get() : frame;
+	curframe->pts = curframe->best_effort_timestamp;
+	int64_t held = frame_bytes(frame) + (_sws_required ? av_image_get_buffer_size(_ovcodec->pix_fmt, _ovcodec->width, _ovcodec->height, 1) : 0);
+	_memory.add(held);
+	stage_timer add_timer(_busy[stage_deinterlace]);
+	rv = av_buffersrc_add_frame_flags(_bufferctx, curframe, AV_BUFFERSRC_FLAG_KEEP_REF);
+	add_timer.stop();
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "av_buffersrc_add_frame_flags", "");
+	}
+	while (true) {
+		avframe_ptr deinterlaced_frame = alloc_frame("deinterlaced");
+		stage_timer timer(_busy[stage_deinterlace]);
+		rv = av_buffersink_get_frame(_buffersinkctx, deinterlaced_frame.get());
+		timer.stop();
+		if ((rv == AVERROR(EAGAIN)) || (rv == AVERROR_EOF)) {
+			break;
+		} else if (rv < 0) {
+			throw ffmpeg_error(rv, "av_buffersink_get_frame", "");
+		}
+		bool black = detect_black_frame(deinterlaced_frame.get());
+		if (_opts.mode == bff_mode::cut) {
+			cut_black_frame(deinterlaced_frame.get(), black);
+		} else if (_opts.mode == bff_mode::hold) {
+			hold_black_frame(deinterlaced_frame.get(), black);
+		} else {
+			substitute_black_frame(deinterlaced_frame.get(), black);
+			encode_video(deinterlaced_frame.get());
+		}
+	}
+	_memory.remove(held);
+}
+
+// narrows the detectors to the picture inside any letterbox bars once they have been found
+void bff_job::update_region(AVFrame * frame)
+{
+	if (_opts.detector.auto_region && !_letterbox.settled() && _letterbox.observe(frame)) {
+		_detector.region = _letterbox.area();
+	}
+}
+
+bool bff_job::detect_black_frame(AVFrame * frame)
+{
+	stage_timer timer(_busy[stage_detect]);
+	bool black;
+	if (_cache && _cache->lookup(_frame_number, frame->pts, black)) {
+		++_stats.cached_verdicts;
+	} else {
+		black = scan_black_frame(frame);
+	}
+	if (_cache) {
+		_cache->record(_frame_number, frame->pts, black);
+	}
+	if (_verdict && !_replaying) {
+		_verdict(_frame_number, frame->pts, black);
+	}
+	++_frame_number;
+	return black;
+}
+
+// runs the detectors on a frame, after the packet size prefilter and the fingerprint if they are enabled
+bool bff_job::scan_black_frame(AVFrame * frame)
+{
+	bool black;
+	update_region(frame);
+	uint64_t fingerprint = 0;
+	bool repeated = false;
+	if (_opts.detector.fingerprint) {
+		fingerprint = frame_fingerprint(frame, _detector);
+		repeated = _have_fingerprint && (fingerprint == _fingerprint);
+	}
+	int packet_size = _opts.detector.packet_prefilter ? _prefilter.size_of(frame) : -1;
+	// only a verdict from the pixels is passed on to a repeat of the frame
+	bool judged = true;
+	if (_opts.detector.packet_prefilter && !_prefilter.could_be_black(frame, packet_size)) {
+		black = false;
+		++_stats.scans_avoided;
+		judged = false;
+		if (_opts.detector.prefilter_verify && is_black_frame(frame, _detector, _workers)) {
+			++_stats.prefilter_misses;
+			black = true;
+		}
+	} else if (repeated) {
+		black = _fingerprint_black;
+		++_stats.fingerprint_hits;
+		if (_opts.detector.fingerprint_verify && (is_black_frame(frame, _detector, _workers) != black)) {
+			++_stats.fingerprint_misses;
+			black = !black;
+		}
+	} else {
+		black = is_black_frame(frame, _detector, _workers);
+	}
+	if (_opts.detector.packet_prefilter) {
+		_prefilter.learn(frame, packet_size, black);
+	}
+	if (_opts.detector.fingerprint) {
+		_fingerprint = fingerprint;
+		_have_fingerprint = judged;
+		_fingerprint_black = black;
+	}
+	return black;
+}
+
+// judges the frame under every configuration of the sweep from a single scan
+void bff_job::sweep_video(AVFrame * frame)
+{
+	frame->pts = frame->best_effort_timestamp;
+	avframe_ptr converted;
+	if (!is_black_frame_supported(frame->format)) {
+		converted = scale_frame(frame, frame->width, frame->height, AV_PIX_FMT_YUV420P);
+		frame = converted.get();
+	}
+	update_region(frame);
+	scan_luma_histogram(frame, _detector, _workers, _histogram);
+	for (bff_sweep_result & result : *_sweep) {
+		if (!is_black_frame(_histogram, result.detector)) {
+			continue;
+		}
+		++result.black_frame_count;
+		if (!result.black_ranges.empty() && (result.black_ranges.back().last + 1 == _frame_number)) {
+			result.black_ranges.back().last = _frame_number;
+		} else {
+			result.black_ranges.push_back(bff_frame_range{ _frame_number, _frame_number });
+		}
+	}
+	++_frame_number;
+}
+
+// replaces a black frame with the most recent non-black frame, or remembers a non-black frame
+void bff_job::substitute_black_frame(AVFrame * frame, bool black)
+{
+	int rv;
+	if (black) {
+		if (_have_prev_frame) {
+			++_stats.black_frame_count;
+			rv = av_frame_copy(frame, _prev_frame.get());
+			if (rv < 0) {
+				throw ffmpeg_error(rv, "av_frame_copy", "deinterlaced");
+			}
+		}
+	} else {
+		remember_frame(frame);
+	}
+}
+
+// keeps a copy of a non-black frame for use in place of later black frames
+void bff_job::remember_frame(AVFrame * frame)
+{
+	int rv;
+	if (!_have_prev_frame) {
+		_prev_frame->format = frame->format;
+		_prev_frame->width = frame->width;
+		_prev_frame->height = frame->height;
+		memcpy(_prev_frame->linesize, frame->linesize, sizeof(_prev_frame->linesize));
+		rv = av_frame_get_buffer(_prev_frame.get(), 0);
+		if (rv < 0) {
+			throw ffmpeg_error(rv, "av_frame_get_buffer", "deinterlaced");
+		}
+		_memory.add(frame_bytes(_prev_frame.get()));
+		_have_prev_frame = true;
+	}
+	rv = av_frame_copy(_prev_frame.get(), frame);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "av_frame_copy", "deinterlaced");
+	}
+	rv = av_frame_copy_props(_prev_frame.get(), frame);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "av_frame_copy_props", "deinterlaced");
+	}
+}
+
+// skips a black frame, leaving the previous frame on screen until the next non-black frame's timestamp
+void bff_job::hold_black_frame(AVFrame * frame, bool black)
+{
+	if (black && _have_prev_frame) {
+		++_stats.black_frame_count;
+		_held_pts = frame->pts;
+		return;
+	}
+	if (!black) {
+		remember_frame(frame);
+	}
+	_held_pts = AV_NOPTS_VALUE;
+	encode_video(frame);
+}
+
+// the duration of a deinterlaced video frame in the video time base
+int64_t bff_job::video_frame_duration(const AVFrame * frame) const
+{
+	if (frame->pkt_duration > 0) {
+		return frame->pkt_duration;
+	}
+	AVRational frame_rate = _ovcodec->framerate;
+	if ((frame_rate.num <= 0) || (frame_rate.den <= 0)) {
+		return 1;
+	}
+	return std::max<int64_t>(av_rescale_q(1, av_inv_q(frame_rate), _ovcodec->time_base), 1);
+}
+
+// drops a black frame, recording its span so that the matching audio can be removed, or retimes a non-black frame
+void bff_job::cut_black_frame(AVFrame * frame, bool black)
+{
+	int64_t duration = video_frame_duration(frame);
+	int64_t start = frame->pts;
+	_video_decided = start + duration;
+	if (black) {
+		++_stats.black_frame_count;
+		_video_cut += duration;
+		if (!_cuts.empty() && (_cuts.back().end == start)) {
+			_cuts.back().end = start + duration;
+		} else {
+			cut_span span = { start, start + duration };
+			_cuts.push_back(span);
+		}
+	} else {
+		frame->pts -= _video_cut;
+		encode_video(frame);
+	}
+	if (_has_audio) {
+		release_audio(false);
+	}
+}
+
+// encodes held audio frames that lie entirely within decided video (or all of them at the end of input)
+void bff_job::release_audio(bool all)
+{
+	AVRational atb = _informat->streams[_audio_stream_index]->time_base;
+	while (!_pending_audio.empty()) {
+		AVFrame * frame = _pending_audio.front().get();
+		int64_t end = frame->pts + av_rescale_q(frame->nb_samples, av_make_q(1, frame->sample_rate), atb);
+		if (!all && ((_video_decided == LLONG_MIN) || (av_rescale_q(end, atb, _ovcodec->time_base) > _video_decided))) {
+			break;
+		}
+		cut_audio_frame(frame);
+		_memory.remove(frame_bytes(frame));
+		_pending_audio.pop_front();
+	}
+}
+
+// removes the samples of an audio frame that fall within cut spans and encodes the rest, retimed to close the gaps
+void bff_job::cut_audio_frame(AVFrame * frame)
+{
+	int rv;
+	AVRational atb = _informat->streams[_audio_stream_index]->time_base;
+	AVRational stb = av_make_q(1, frame->sample_rate);
+	AVRational vtb = _ovcodec->time_base;
+	int64_t first = av_rescale_q(frame->pts, atb, stb);
+	int64_t last = first + frame->nb_samples;
+	// ranges of samples to keep, relative to the start of the frame
+	std::vector<std::pair<int, int>> keep;
+	int64_t pos = first;
+	while (!_cuts.empty()) {
+		int64_t a = av_rescale_q(_cuts.front().start, vtb, stb);
+		int64_t b = av_rescale_q(_cuts.front().end, vtb, stb);
+		if (a >= last) {
+			break;
+		}
+		if (a > pos) {
+			keep.push_back(std::make_pair((int)(pos - first), (int)(a - pos)));
+		}
+		pos = std::max(pos, std::min(b, last));
+		if (b > last) {
+			break;
+		}
+		_cuts.pop_front();
+	}
+	if (pos < last) {
+		keep.push_back(std::make_pair((int)(pos - first), (int)(last - pos)));
+	}
+	int kept = 0;
+	for (const std::pair<int, int> & range : keep) {
+		kept += range.second;
+	}
+	int64_t pts = av_rescale_q(first - _audio_removed, stb, atb);
+	_audio_removed += frame->nb_samples - kept;
+	_stats.audio_samples_cut += frame->nb_samples - kept;
+	if (kept == frame->nb_samples) {
+		frame->pts = pts;
+		encode_audio(frame);
+	} else if (kept > 0) {
+		avframe_ptr trimmed = alloc_frame("cut audio");
+		trimmed->format = frame->format;
+		trimmed->channels = frame->channels;
+		trimmed->channel_layout = frame->channel_layout;
+		trimmed->sample_rate = frame->sample_rate;
+		trimmed->nb_samples = kept;
+		rv = av_frame_get_buffer(trimmed.get(), 0);
+		if (rv < 0) {
+			throw ffmpeg_error(rv, "av_frame_get_buffer", "cut audio");
+		}
+		int offset = 0;
+		for (const std::pair<int, int> & range : keep) {
+			av_samples_copy(trimmed->extended_data, frame->extended_data, offset, range.first, range.second, frame->channels, (AVSampleFormat)frame->format);
+			offset += range.second;
+		}
+		trimmed->pts = pts;
+		encode_audio(trimmed.get());
+	}
+}
+
+// sends a frame (or nullptr to flush) to the video encoder and writes whatever packets it produces
+void bff_job::encode_video(AVFrame * frame)
+{
+	if (_replaying) {
+		return;
+	}
+	if (frame) {
+		for (std::unique_ptr<rendition> & r : _renditions) {
+			r->write_video(frame);
+		}
+	}
+	stage_timer send_timer(_busy[stage_encode]);
+	int rv = avcodec_send_frame(_ovcodec.get(), frame);
+	send_timer.stop();
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avcodec_send_frame", frame ? "output video" : "flush video");
+	}
+	if (frame) {
+		// the encoder keeps its own copy until the frame's packet comes out
+		_encoding.push_back(av_image_get_buffer_size(_ovcodec->pix_fmt, _ovcodec->width, _ovcodec->height, 1));
+		_memory.add(_encoding.back());
+	}
+	while (true) {
+		avpacket_ptr outpacket = alloc_packet("output video");
+		stage_timer timer(_busy[stage_encode]);
+		rv = avcodec_receive_packet(_ovcodec.get(), outpacket.get());
+		timer.stop();
+		if (rv >= 0) {
+			if (!_encoding.empty()) {
+				_memory.remove(_encoding.front());
+				_encoding.pop_front();
+			}
+			++_stats.video_packet_count;
+			write_packet(outpacket.get(), _ovcodec.get(), _ovstream, _vpts, _vdts);
+		} else if (rv == AVERROR(EAGAIN) || (!frame && (rv == AVERROR_EOF))) {
+			break;
+		} else {
+			throw ffmpeg_error(rv, "avcodec_receive_packet", frame ? "output video" : "flush video");
+		}
+	}
+}
+
+// starts the audio thread; audio packets are queued for it from here on
+void bff_job::start_audio()
+{
+	_audio_packets.reset(new packet_queue(muxer::default_max_packets, muxer::default_max_bytes / 4, &_memory));
+	_audio_thread = std::thread(&bff_job::run_audio, this);
+}
+
+void bff_job::run_audio()
+{
+	try {
+		avpacket_ptr packet = alloc_packet("audio");
+		while (_audio_packets->pop(packet.get())) {
+			// an empty packet drains the decoder at the end of the requested range
+			decode_audio(packet->data ? packet.get() : nullptr);
+			av_packet_unref(packet.get());
+			publish_audio();
+		}
+		encode_audio(nullptr);
+		publish_audio();
+	} catch (...) {
+		_audio_error = std::current_exception();
+		// unblock the demuxer; the packets still queued will never be decoded
+		_audio_packets->close();
+		_audio_packets->clear();
+	}
+}
+
+// waits for the audio thread to encode everything queued for it
+void bff_job::finish_audio()
+{
+	if (!_audio_packets) {
+		return;
+	}
+	_audio_packets->close();
+	if (_audio_thread.joinable()) {
+		_audio_thread.join();
+	}
+	if (_audio_error) {
+		std::rethrow_exception(_audio_error);
+	}
+}
+
+// decodes an audio packet (or drains the decoder, given nullptr) here or on the audio thread
+void bff_job::process_audio(AVPacket * packet)
+{
+	if (!_audio_packets) {
+		decode_audio(packet);
+		publish_audio();
+		return;
+	}
+	avpacket_ptr drain;
+	if (!packet) {
+		drain = alloc_packet("drain audio");
+		packet = drain.get();
+	}
+	if (!_audio_packets->push(packet)) {
+		// the audio thread has failed
+		finish_audio();
+		throw ffmpeg_error(AVERROR_EXIT, "process_audio", "closed");
+	}
+}
+
+void bff_job::publish_audio()
+{
+	std::lock_guard<std::mutex> lock(_audio_mutex);
+	_audio_published = _audio;
+}
+
+// brings the audio counters in _stats up to date with those last published
+void bff_job::collect_audio_stats()
+{
+	std::lock_guard<std::mutex> lock(_audio_mutex);
+	_stats.audio_frame_count = _audio_published.frames;
+	_stats.audio_packet_count = _audio_published.packets;
+}
+
+void bff_job::decode_audio(AVPacket * packet)
+{
+	stage_timer send_timer(_audio.busy[stage_decode]);
+	int rv = avcodec_send_packet(_inacodec.get(), packet);
+	send_timer.stop();
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avcodec_send_packet", "input audio");
+	}
+	while (rv >= 0) {
+		avframe_ptr frame = alloc_frame("input audio");
+		stage_timer timer(_audio.busy[stage_decode]);
+		rv = avcodec_receive_frame(_inacodec.get(), frame.get());
+		timer.stop();
+		if (rv == AVERROR(EAGAIN) || rv == AVERROR_EOF) {
+			break;
+		} else if (rv < 0) {
+			throw ffmpeg_error(rv, "avcodec_receive_frame", "input audio");
+		} else if (_resume && (frame->best_effort_timestamp + av_rescale_q(frame->nb_samples, av_make_q(1, frame->sample_rate), _oacodec->time_base) <= _resume->audio_end)) {
+			// already in the output
+			continue;
+		} else if (before_start(frame->best_effort_timestamp + av_rescale_q(frame->nb_samples, av_make_q(1, frame->sample_rate), _informat->streams[_audio_stream_index]->time_base), _informat->streams[_audio_stream_index]->time_base) || after_end(frame->best_effort_timestamp, _informat->streams[_audio_stream_index]->time_base)) {
+			// entirely outside the requested range
+			continue;
+		} else {
+			++_audio.frames;
+			std::unique_ptr<AVFrame, std::function<void(AVFrame*)>> swr_frame(_swr_required ? av_frame_alloc() : nullptr, [](AVFrame * p) {
+				if (p) {
+					av_freep(p->data);
+					av_frame_free(&p);
+				}
+			});
+			if (_swr_required && !swr_frame) {
+				throw ffmpeg_error(AVERROR_UNKNOWN, "av_frame_alloc", "swr");
+			}
+			if (_swr_required) {
+				std::unique_ptr<SwrContext, std::function<void(SwrContext*)>> swr(swr_alloc_set_opts(nullptr, _oacodec->channel_layout, _oacodec->sample_fmt, _oacodec->sample_rate, _inacodec->channel_layout, _inacodec->sample_fmt, _inacodec->sample_rate, 0, nullptr), [](SwrContext *p) {
+					if (p) {
+						swr_free(&p);
+					}
+				});
+				swr_frame->format = _oacodec->sample_fmt;
+				swr_frame->channels = _oacodec->channels;
+				swr_frame->channel_layout = _oacodec->channel_layout;
+				swr_frame->sample_rate = _oacodec->sample_rate;
+				swr_frame->nb_samples = swr_get_out_samples(swr.get(), frame->nb_samples);
+				rv = av_samples_alloc(swr_frame->data, swr_frame->linesize, swr_frame->channels, swr_frame->nb_samples, (AVSampleFormat)swr_frame->format, 32);
+				if (rv < 0) {
+					throw ffmpeg_error(rv, "av_samples_alloc", "swr");
+				}
+				if (!frame->channels || !frame->channel_layout) {
+					frame->channels = _oacodec->channels;
+					frame->channel_layout = _oacodec->channel_layout;
+				}
+				rv = swr_convert_frame(swr.get(), swr_frame.get(), frame.get());
+				if (rv < 0) {
+					throw ffmpeg_error(rv, "swr_convert_frame", "");
+				}
+				rv = av_frame_copy_props(swr_frame.get(), frame.get());
+				if (rv < 0) {
+					throw ffmpeg_error(rv, "av_frame_copy_props", "swr");
+				}
+			}
+			AVFrame * curframe = _swr_required ? swr_frame.get() : frame.get();
+			curframe->pts = curframe->best_effort_timestamp;
+			if (_opts.mode == bff_mode::cut) {
+				// hold the audio until the video it accompanies has been decided
+				avframe_ptr pending(av_frame_clone(curframe), [](AVFrame * p) {
+					av_frame_free(&p);
+				});
+				if (!pending) {
+					throw ffmpeg_error(AVERROR(ENOMEM), "av_frame_clone", "audio");
+				}
+				_memory.add(frame_bytes(pending.get()));
+				_pending_audio.push_back(std::move(pending));
+				release_audio(false);
+			} else {
+				encode_audio(curframe);
+			}
+		}
+	}
+}
+
+// regroups the samples of an audio frame into frames of the encoder's frame size and encodes them; given nullptr,
+// encodes what is left as a short final frame and flushes the encoder
+void bff_job::encode_audio(AVFrame * frame)
+{
+	if (!_audio_fifo) {
+		if (frame || (_oacodec->codec->capabilities & AV_CODEC_CAP_DELAY)) {
+			send_audio(frame);
+		}
+		return;
+	}
+	int rv;
+	if (frame) {
+		if (av_audio_fifo_size(_audio_fifo.get()) == 0) {
+			_fifo_pts = frame->pts;
+			_fifo_samples = 0;
+		}
+		rv = av_audio_fifo_write(_audio_fifo.get(), (void **)frame->extended_data, frame->nb_samples);
+		if (rv < frame->nb_samples) {
+			throw ffmpeg_error(rv < 0 ? rv : AVERROR(ENOMEM), "av_audio_fifo_write", "audio");
+		}
+	}
+	int frame_size = _oacodec->frame_size;
+	while ((av_audio_fifo_size(_audio_fifo.get()) >= frame_size) || (!frame && (av_audio_fifo_size(_audio_fifo.get()) > 0))) {
+		// the encoder may still reference the last frame sent, in which case the buffer is replaced
+		_fifo_frame->nb_samples = frame_size;
+		rv = av_frame_make_writable(_fifo_frame.get());
+		if (rv < 0) {
+			throw ffmpeg_error(rv, "av_frame_make_writable", "audio");
+		}
+		int samples = std::min(av_audio_fifo_size(_audio_fifo.get()), frame_size);
+		rv = av_audio_fifo_read(_audio_fifo.get(), (void **)_fifo_frame->extended_data, samples);
+		if (rv < samples) {
+			throw ffmpeg_error(rv < 0 ? rv : AVERROR_BUG, "av_audio_fifo_read", "audio");
+		}
+		_fifo_frame->nb_samples = samples;
+		_fifo_frame->pts = _fifo_pts + av_rescale_q(_fifo_samples, av_make_q(1, _oacodec->sample_rate), _oacodec->time_base);
+		_fifo_samples += samples;
+		send_audio(_fifo_frame.get());
+	}
+	if (!frame && (_oacodec->codec->capabilities & AV_CODEC_CAP_DELAY)) {
+		send_audio(nullptr);
+	}
+}
+
+// sends a frame (or nullptr to flush) to the audio encoder and writes whatever packets it produces
+void bff_job::send_audio(AVFrame * frame)
+{
+	stage_timer send_timer(_audio.busy[stage_encode]);
+	int rv = avcodec_send_frame(_oacodec.get(), frame);
+	send_timer.stop();
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avcodec_send_frame", frame ? "audio" : "flush audio");
+	}
+	while (true) {
+		avpacket_ptr outpacket = alloc_packet("output audio");
+		stage_timer timer(_audio.busy[stage_encode]);
+		rv = avcodec_receive_packet(_oacodec.get(), outpacket.get());
+		timer.stop();
+		if (rv >= 0) {
+			++_audio.packets;
+			write_packet(outpacket.get(), _oacodec.get(), _oastream, _apts, _adts);
+		} else if (rv == AVERROR(EAGAIN) || (!frame && (rv == AVERROR_EOF))) {
+			break;
+		} else {
+			throw ffmpeg_error(rv, "avcodec_receive_packet", frame ? "audio" : "flush audio");
+		}
+	}
+}
+
+// rescales an encoded packet to its stream, keeps its timestamps strictly increasing and queues it for the muxer
+void bff_job::write_packet(AVPacket * packet, AVCodecContext * codec, AVStream * stream, int64_t & pts, int64_t & dts)
+{
+	packet->stream_index = stream->index;
+	if (!_checkpoint_file.empty() && (stream == _ovstream) && (packet->flags & AV_PKT_FLAG_KEY)) {
+		// each keyframe starts a fragment; a checkpoint keeps everything before it
+		while (!_snapshots.empty() && (_snapshots.front().pts < packet->pts)) {
+			_snapshots.pop_front();
+		}
+		if (_checkpoint_dts == AV_NOPTS_VALUE) {
+			_checkpoint_dts = packet->dts;
+		} else if ((_opts.checkpoint_interval > 0) && ((packet->dts - _checkpoint_dts) * av_q2d(codec->time_base) >= _opts.checkpoint_interval)) {
+			checkpoint(packet->pts, packet->dts);
+		}
+		++_fragments;
+	}
+	rescale_packet(packet, codec->time_base, stream->time_base, pts, dts);
+	if (stream == _oastream) {
+		_aend = packet->pts + packet->duration;
+		for (std::unique_ptr<rendition> & r : _renditions) {
+			r->write_audio(packet, stream->time_base);
+		}
+	}
+	_mux->write(packet);
+}
+
+
+// hands a snapshot of the run to the metrics writer
+void bff_job::publish_metrics()
+{
+	if (!_metrics) {
+		return;
+	}
+	collect_audio_stats();
+	job_metrics metrics;
+	metrics.stats = _stats;
+	{
+		std::lock_guard<std::mutex> lock(_audio_mutex);
+		for (int i = 0; i < stage_count; ++i) {
+			metrics.busy[i] = _busy[i] + _audio_published.busy[i];
+		}
+	}
+	if (_mux) {
+		metrics.busy[stage_mux] = _mux->busy();
+		_mux->depth(metrics.mux_queue_packets, metrics.mux_queue_bytes);
+	}
+	metrics.encoder_frames = _encoding.size();
+	metrics.held_audio_frames = _pending_audio.size();
+	if (_read_packets) {
+		_read_packets->depth(metrics.read_queue_packets, metrics.read_queue_bytes);
+		metrics.bytes_read = _read_bytes;
+	} else {
+		metrics.bytes_read = (_informat && _informat->pb) ? _informat->pb->bytes_read : 0;
+	}
+	metrics.bytes_written = _output_io ? _output_io->bytes_written() : 0;
+	metrics.memory_bytes = _memory.live();
+	_metrics->update(metrics);
+}
+
+bff_pipeline::bff_pipeline(const bff_options & options) : _options(options)
+{
+	static std::once_flag registered;
+	std::call_once(registered, []() {
+		av_register_all();
+		avfilter_register_all();
+	});
+}
+
+// how the output file of an input file is to be written
+static output_hints output_hints_for(const bff_options & options, const std::string & input)
+{
+	output_hints hints;
+	hints.drop_cache = options.output_drop_cache;
+	hints.direct = options.output_direct_io;
+	struct stat st = {};
+	if (options.output_preallocate && (stat(input.c_str(), &st) == 0)) {
+		// filtering barely changes the size of a typical capture
+		hints.preallocate = st.st_size;
+	}
+	return hints;
+}
+
+bff_stats bff_pipeline::process(const std::string & input, const std::string & output)
+{
+	bff_job job(_options, _progress, _verdict);
+	// the cache holds the verdicts of whole inputs, so a run over part of one neither uses nor updates it
+	if ((_options.detection_cache || _options.refresh_detection_cache) && (_options.start <= 0) && (_options.end <= 0)) {
+		std::unique_ptr<verdict_cache> cache(new verdict_cache(input, _options.detector));
+		if (!_options.refresh_detection_cache) {
+			cache->load();
+		}
+		job.cache_verdicts(cache.release());
+	}
+	if ((_options.checkpoint_interval <= 0) && !_options.resume) {
+		job.run(input, nullptr, output, new output_file(output, output_hints_for(_options, input)));
+		return job.stats();
+	}
+	if (_options.mode == bff_mode::cut) {
+		// the audio held back and the cut spans pending at a checkpoint are not saved
+		throw ffmpeg_error(AVERROR(ENOSYS), "checkpoint", "cut");
+	}
+	std::string state_file = _options.checkpoint_file.empty() ? output + ".checkpoint" : _options.checkpoint_file;
+	checkpoint_state state;
+	struct stat st = {};
+	bool resuming = _options.resume && state.load(state_file) && (state.input == input) && (stat(output.c_str(), &st) == 0) && (st.st_size >= state.output_size);
+	job.checkpoint_to(state_file, resuming ? &state : nullptr);
+	job.run(input, nullptr, output, resuming ? new output_file(output, state.output_size, output_hints_for(_options, input)) : new output_file(output, output_hints_for(_options, input)));
+	// the output is complete, so there is nothing left to resume
+	remove(state_file.c_str());
+	return job.stats();
+}
+
+bff_stats bff_pipeline::process(bff_reader & input, bff_writer & output)
+{
+	bff_job job(_options, _progress, _verdict);
+	std::unique_ptr<custom_io> input_io(new callback_io(input));
+	std::unique_ptr<custom_io> output_io(new callback_io(output));
+	job.run("", input_io.release(), "", output_io.release());
+	return job.stats();
+}
+
+std::vector<bff_sweep_result> bff_pipeline::sweep(const std::string & input, const std::vector<bff_detector_options> & configs)
+{
+	std::vector<bff_sweep_result> results(configs.size());
+	for (size_t i = 0; i < configs.size(); ++i) {
+		results[i].detector = configs[i];
+	}
+	bff_job job(_options, _progress, _verdict);
+	job.sweep(input, nullptr, results);
+	return results;
+}
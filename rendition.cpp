@@ -0,0 +1,286 @@
+/*	bff - Black Frame Filter for FFmpeg
+	Copyright (C) 2017 Michael Trenholm-Boyle.
+	This software is redistributable under a permissive open source license.
+	See the LICENSE file for further information. */
+#include "stdafx.h"
+
+#include "bff.h"
+
+extern "C" {
+#include <libavutil/avstring.h>
+#include <libswscale/swscale.h>
+}
+
+
+// the size of a rendition's pictures, keeping the aspect ratio where only one dimension is given; always even for 4:2:0
+void rendition::frame_size(const bff_rendition & spec, const AVCodecContext * video, int & width, int & height)
+{
+	width = spec.width;
+	height = spec.height;
+	if (!width && !height) {
+		width = video->width;
+		height = video->height;
+	} else if (!width) {
+		width = (int)av_rescale(height, video->width, video->height);
+	} else if (!height) {
+		height = (int)av_rescale(width, video->height, video->width);
+	}
+	width = std::max(2, (width + 1) & ~1);
+	height = std::max(2, (height + 1) & ~1);
+}
+
+rendition::rendition(const bff_rendition & spec, const AVCodecContext * video, const AVCodecContext * audio, const AVStream * audio_stream, int lookahead, size_t queue_bytes, memory_account * account, const output_hints & hints) : _spec(spec), _account(account), _vstream(nullptr), _astream(nullptr), _vpts(LLONG_MIN), _vdts(LLONG_MIN), _apts(LLONG_MIN), _adts(LLONG_MIN), _ended(false)
+{
+	int rv;
+	int width, height;
+	frame_size(spec, video, width, height);
+	_io.reset(new output_file(spec.output, hints));
+	_format = avformat_ptr(avformat_alloc_context(), [](AVFormatContext *p) {
+		avformat_free_context(p);
+	});
+	_format->pb = _io->context();
+	_format->flags |= AVFMT_FLAG_CUSTOM_IO;
+	_format->oformat = av_guess_format("mp4", nullptr, nullptr);
+	av_strlcpy(_format->filename, spec.output.c_str(), sizeof(_format->filename));
+	AVCodec * h264 = avcodec_find_encoder(AV_CODEC_ID_H264);
+	_vstream = avformat_new_stream(_format.get(), h264);
+	_codec = avcodec_ptr(avcodec_alloc_context3(h264), [](AVCodecContext *p) {
+		avcodec_free_context(&p);
+	});
+	_codec->pix_fmt = AV_PIX_FMT_YUV420P;
+	_codec->width = width;
+	_codec->height = height;
+	_codec->framerate = video->framerate;
+	_codec->time_base = video->time_base;
+	// scaling both dimensions alike keeps the pixel shape; otherwise the pixels are reshaped to keep the display aspect
+	AVRational sar = video->sample_aspect_ratio.num ? video->sample_aspect_ratio : av_make_q(1, 1);
+	av_reduce(&_codec->sample_aspect_ratio.num, &_codec->sample_aspect_ratio.den, (int64_t)sar.num * video->width * height, (int64_t)sar.den * video->height * width, INT_MAX);
+	if (_format->oformat->flags & AVFMT_GLOBALHEADER) {
+		_codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	}
+	std::unique_ptr<AVDictionary*, std::function<void(AVDictionary**)>> vopts((AVDictionary **)calloc(1, sizeof(AVDictionary*)), [](AVDictionary **p) {
+		if (*p) {
+			av_dict_free(p);
+		}
+		if (p) {
+			free(p);
+		}
+	});
+	av_dict_set(vopts.get(), "profile", "Main", 0);
+	av_dict_set(vopts.get(), "level", "4.1", 0);
+	av_dict_set(vopts.get(), "preset", "slow", 0);
+	if (spec.bit_rate > 0) {
+		_codec->bit_rate = spec.bit_rate;
+		_codec->rc_max_rate = spec.bit_rate;
+		_codec->rc_buffer_size = (int)std::min<int64_t>(2 * spec.bit_rate, INT_MAX);
+	} else {
+		av_dict_set(vopts.get(), "crf", "18", 0);
+	}
+	if (lookahead >= 0) {
+		av_dict_set_int(vopts.get(), "rc-lookahead", lookahead, 0);
+	}
+	rv = avcodec_open2(_codec.get(), h264, vopts.get());
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avcodec_open2", spec.output.c_str());
+	}
+	rv = avcodec_parameters_from_context(_vstream->codecpar, _codec.get());
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avcodec_parameters_from_context", spec.output.c_str());
+	}
+	_vstream->time_base = _codec->time_base;
+	if (audio) {
+		// the audio is encoded once by the main output and its packets copied here
+		_astream = avformat_new_stream(_format.get(), nullptr);
+		rv = avcodec_parameters_copy(_astream->codecpar, audio_stream->codecpar);
+		if (rv < 0) {
+			throw ffmpeg_error(rv, "avcodec_parameters_copy", spec.output.c_str());
+		}
+		_astream->time_base = audio->time_base;
+	}
+	AVDictionary * fopts = nullptr;
+	if (!_format->pb->seekable) {
+		av_dict_set(&fopts, "movflags", "frag_keyframe+empty_moov", 0);
+	}
+	rv = avformat_write_header(_format.get(), &fopts);
+	av_dict_free(&fopts);
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avformat_write_header", spec.output.c_str());
+	}
+	_sws = std::unique_ptr<SwsContext, std::function<void(SwsContext*)>>(sws_getContext(video->width, video->height, video->pix_fmt, width, height, _codec->pix_fmt, SWS_BICUBIC, nullptr, nullptr, nullptr), [](SwsContext *p) {
+		if (p) {
+			sws_freeContext(p);
+		}
+	});
+	if (!_sws) {
+		throw ffmpeg_error(AVERROR(EINVAL), "sws_getContext", spec.output.c_str());
+	}
+	_mux.reset(new muxer(_format.get(), muxer::default_max_packets, queue_bytes, account));
+	_thread = std::thread(&rendition::run, this);
+}
+
+rendition::~rendition()
+{
+	stop();
+}
+
+// ends the encoder thread, dropping any frames it has not taken
+void rendition::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_ended = true;
+		for (avframe_ptr & frame : _frames) {
+			_account->remove(av_image_get_buffer_size((AVPixelFormat)frame->format, frame->width, frame->height, 1));
+		}
+		_frames.clear();
+		_not_empty.notify_all();
+		_not_full.notify_all();
+	}
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+}
+
+// queues a reference to a frame for the encoder thread, waiting while it is behind
+void rendition::write_video(const AVFrame * frame)
+{
+	avframe_ptr ref(av_frame_clone(frame), [](AVFrame * p) {
+		av_frame_free(&p);
+	});
+	if (!ref) {
+		throw ffmpeg_error(AVERROR(ENOMEM), "av_frame_clone", _spec.output.c_str());
+	}
+	std::unique_lock<std::mutex> lock(_mutex);
+	_not_full.wait(lock, [this]() {
+		return _ended || (_frames.size() < max_frames);
+	});
+	if (_ended) {
+		// the encoder thread has failed
+		if (_error) {
+			std::rethrow_exception(_error);
+		}
+		throw ffmpeg_error(AVERROR_EXIT, "rendition", _spec.output.c_str());
+	}
+	_account->add(av_image_get_buffer_size((AVPixelFormat)ref->format, ref->width, ref->height, 1));
+	_frames.push_back(std::move(ref));
+	_not_empty.notify_one();
+}
+
+// queues a copy of an encoded audio packet of the main output, whose timestamps are in time_base
+void rendition::write_audio(const AVPacket * packet, AVRational time_base)
+{
+	if (!_astream) {
+		return;
+	}
+	avpacket_ptr copy(av_packet_clone(packet), [](AVPacket *p) {
+		av_packet_free(&p);
+	});
+	if (!copy) {
+		throw ffmpeg_error(AVERROR(ENOMEM), "av_packet_clone", _spec.output.c_str());
+	}
+	copy->stream_index = _astream->index;
+	rescale_packet(copy.get(), time_base, _astream->time_base, _apts, _adts);
+	_mux->write(copy.get());
+}
+
+void rendition::run()
+{
+	try {
+		while (true) {
+			avframe_ptr frame;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_not_empty.wait(lock, [this]() {
+					return _ended || !_frames.empty();
+				});
+				if (_frames.empty()) {
+					break;
+				}
+				frame = std::move(_frames.front());
+				_frames.pop_front();
+				_not_full.notify_one();
+			}
+			_account->remove(av_image_get_buffer_size((AVPixelFormat)frame->format, frame->width, frame->height, 1));
+			encode(frame.get());
+		}
+		encode(nullptr);
+	} catch (...) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_error = std::current_exception();
+		_ended = true;
+		_not_full.notify_all();
+	}
+}
+
+// scales a frame (or, given nullptr, flushes the encoder) and writes whatever packets the encoder produces
+void rendition::encode(AVFrame * frame)
+{
+	int rv;
+	avframe_ptr scaled;
+	if (frame) {
+		scaled = avframe_ptr(av_frame_alloc(), [](AVFrame * p) {
+			av_frame_free(&p);
+		});
+		if (!scaled) {
+			throw ffmpeg_error(AVERROR(ENOMEM), "av_frame_alloc", _spec.output.c_str());
+		}
+		scaled->format = _codec->pix_fmt;
+		scaled->width = _codec->width;
+		scaled->height = _codec->height;
+		rv = av_frame_get_buffer(scaled.get(), 32);
+		if (rv < 0) {
+			throw ffmpeg_error(rv, "av_frame_get_buffer", _spec.output.c_str());
+		}
+		rv = sws_scale(_sws.get(), frame->data, frame->linesize, 0, frame->height, scaled->data, scaled->linesize);
+		if (rv < 0) {
+			throw ffmpeg_error(rv, "sws_scale", _spec.output.c_str());
+		}
+		rv = av_frame_copy_props(scaled.get(), frame);
+		if (rv < 0) {
+			throw ffmpeg_error(rv, "av_frame_copy_props", _spec.output.c_str());
+		}
+	}
+	rv = avcodec_send_frame(_codec.get(), scaled.get());
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "avcodec_send_frame", _spec.output.c_str());
+	}
+	while (true) {
+		avpacket_ptr packet(av_packet_alloc(), [](AVPacket *p) {
+			av_packet_free(&p);
+		});
+		if (!packet) {
+			throw ffmpeg_error(AVERROR(ENOMEM), "av_packet_alloc", _spec.output.c_str());
+		}
+		rv = avcodec_receive_packet(_codec.get(), packet.get());
+		if (rv == AVERROR(EAGAIN) || (!frame && (rv == AVERROR_EOF))) {
+			break;
+		} else if (rv < 0) {
+			throw ffmpeg_error(rv, "avcodec_receive_packet", _spec.output.c_str());
+		}
+		packet->stream_index = _vstream->index;
+		rescale_packet(packet.get(), _codec->time_base, _vstream->time_base, _vpts, _vdts);
+		_mux->write(packet.get());
+	}
+}
+
+// waits for the encoder thread to encode every frame queued, then completes the file
+void rendition::finish()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_ended = true;
+		_not_empty.notify_all();
+	}
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	if (_error) {
+		std::rethrow_exception(_error);
+	}
+	_mux->finish();
+	int rv = av_write_trailer(_format.get());
+	if (rv < 0) {
+		throw ffmpeg_error(rv, "av_write_trailer", _spec.output.c_str());
+	}
+	_io->finish();
+}
@@ -4,19 +4,37 @@
 	See the LICENSE file for further information. */
 #pragma once
 
+#ifdef _WIN32
 #include "targetver.h"
 #include <Windows.h>
+#include <tchar.h>
+#else
+#include <alloca.h>
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
 #include <string>
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
-#include <tchar.h>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cmath>
 #include <memory>
 #include <functional>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include <atomic>
+#include <chrono>
 
 extern "C" {
-#include <libavutil\avutil.h>
-#include <libavcodec\avcodec.h>
-#include <libavformat\avformat.h>
-#include <libavfilter\avfilter.h>
+#include <libavutil/avutil.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavfilter/avfilter.h>
 }
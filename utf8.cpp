@@ -1,6 +1,8 @@
 #include "stdafx.h"
 #include "bff.h"
 
+#ifdef _WIN32
+
 std::string utf8(const std::wstring & s)
 {
 	int len = WideCharToMultiByte(CP_UTF8, 0, s.c_str(), (int)s.length(), nullptr, 0, nullptr, nullptr);
@@ -36,3 +38,46 @@ std::wstring ansi(const std::string & s)
 	MultiByteToWideChar(CP_THREAD_ACP, MB_PRECOMPOSED, s.c_str(), (int)s.length(), buf, len + 1);
 	return std::wstring(buf);
 }
+
+#else
+
+#include <codecvt>
+#include <locale>
+#include <vector>
+
+std::string utf8(const std::wstring & s)
+{
+	std::wstring_convert<std::codecvt_utf8<wchar_t>> conv;
+	return conv.to_bytes(s);
+}
+
+std::wstring utf8(const std::string & s)
+{
+	std::wstring_convert<std::codecvt_utf8<wchar_t>> conv;
+	return conv.from_bytes(s);
+}
+
+// the POSIX analogue of the ANSI code page is the multibyte encoding of the current locale
+std::string ansi(const std::wstring & s)
+{
+	size_t len = wcstombs(nullptr, s.c_str(), 0);
+	if (len == (size_t)-1) {
+		return utf8(s);
+	}
+	std::vector<char> buf(len + 1, 0);
+	wcstombs(buf.data(), s.c_str(), len + 1);
+	return std::string(buf.data());
+}
+
+std::wstring ansi(const std::string & s)
+{
+	size_t len = mbstowcs(nullptr, s.c_str(), 0);
+	if (len == (size_t)-1) {
+		return utf8(s);
+	}
+	std::vector<wchar_t> buf(len + 1, 0);
+	mbstowcs(buf.data(), s.c_str(), len + 1);
+	return std::wstring(buf.data());
+}
+
+#endif
@@ -0,0 +1,119 @@
+/*	bff - Black Frame Filter for FFmpeg
+	Copyright (C) 2017 Michael Trenholm-Boyle.
+	This software is redistributable under a permissive open source license.
+	See the LICENSE file for further information. */
+#include "stdafx.h"
+
+#include "bff.h"
+
+
+// starts threads - 1 workers; the thread calling run() is always the last worker
+worker_pool::worker_pool(int threads) : _task(nullptr), _tasks(0), _next(0), _pending(0), _generation(0), _stop(false)
+{
+	for (int i = 1; i < threads; ++i) {
+		_threads.push_back(std::thread(&worker_pool::work, this));
+	}
+}
+
+worker_pool::~worker_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+		_work.notify_all();
+	}
+	for (std::thread & t : _threads) {
+		t.join();
+	}
+}
+
+// the number of threads run() spreads its tasks over (given 0, one per hardware thread)
+int worker_pool::default_threads(int threads)
+{
+	if (threads > 0) {
+		return threads;
+	}
+	unsigned n = std::thread::hardware_concurrency();
+	return n > 0 ? (int)n : 1;
+}
+
+// a pool kept for the calling thread and reused by whatever it runs next, so that a thread filtering one input after
+// another (e.g. a daemon's) starts each with warm workers; replaced only when a different size is asked for
+worker_pool * worker_pool::for_this_thread(int threads)
+{
+	thread_local std::unique_ptr<worker_pool> pool;
+	if (!pool || (pool->size() != threads)) {
+		pool.reset(new worker_pool(threads));
+	}
+	return pool.get();
+}
+
+// takes and runs tasks of the current generation until none are left
+void worker_pool::drain(std::unique_lock<std::mutex> & lock)
+{
+	while (_next < _tasks) {
+		int i = _next++;
+		const std::function<void(int)> & task = *_task;
+		lock.unlock();
+		try {
+			task(i);
+		} catch (...) {
+			lock.lock();
+			if (!_error) {
+				_error = std::current_exception();
+			}
+			lock.unlock();
+		}
+		lock.lock();
+		if (--_pending == 0) {
+			_done.notify_all();
+		}
+	}
+}
+
+void worker_pool::work()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	uint64_t seen = _generation;
+	for (;;) {
+		_work.wait(lock, [this, seen]() {
+			return _stop || (_generation != seen);
+		});
+		if (_stop) {
+			return;
+		}
+		seen = _generation;
+		drain(lock);
+	}
+}
+
+// calls task(0) ... task(tasks - 1) across the pool and returns once all have finished,
+// rethrowing the first exception any of them threw; not reentrant
+void worker_pool::run(int tasks, const std::function<void(int)> & task)
+{
+	if (_threads.empty() || (tasks <= 1)) {
+		for (int i = 0; i < tasks; ++i) {
+			task(i);
+		}
+		return;
+	}
+	std::unique_lock<std::mutex> lock(_mutex);
+	_task = &task;
+	_tasks = tasks;
+	_next = 0;
+	_pending = tasks;
+	_error = nullptr;
+	++_generation;
+	_work.notify_all();
+	drain(lock);
+	_done.wait(lock, [this]() {
+		return _pending == 0;
+	});
+	_task = nullptr;
+	_tasks = 0;
+	if (_error) {
+		std::exception_ptr error = _error;
+		_error = nullptr;
+		std::rethrow_exception(error);
+	}
+}